@@ -30,6 +30,13 @@
 #include <linux/module.h>
 #include <linux/kref.h>
 #include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
 #include <asm/uaccess.h>
 #include <asm/atomic.h>
 #ifdef CONFIG_COMPAT
@@ -61,6 +68,14 @@ extern struct snd_hdj_chip *usb_chip[SNDRV_CARDS];
 
 int buffer_queue_depth = 0;
 
+static int reader_queue_depth = HDJ_READ_RING_DEPTH_DEFAULT;
+module_param(reader_queue_depth, int, 0444);
+MODULE_PARM_DESC(reader_queue_depth, "Input reports queued per reader (2-256, rounded up to a power of 2).");
+
+static int input_urb_count = DJ_POLL_INPUT_URB_COUNT;
+module_param(input_urb_count, int, 0444);
+MODULE_PARM_DESC(input_urb_count, "Input URBs kept in flight per device (2-32).");
+
 /* BCD, currently 1.28.0.0 */
 u32 driver_version = 0x1280000;
 
@@ -73,6 +88,26 @@ static int can_send_urbs(struct snd_hdj_chip* chip)
 	return 0;
 }
 
+/* size of the shared input ring mapping, in bytes */
+static u32 get_input_ring_map_size(void)
+{
+	return PAGE_ALIGN(sizeof(struct dj_input_ring_header) + 
+				DJ_INPUT_RING_NUM_REPORTS*DJ_INPUT_RING_REPORT_SIZE);
+}
+
+static int set_read_flags(struct usb_hdjbulk *ubulk, struct file *file, u32 read_flags);
+static int get_read_flags(struct usb_hdjbulk *ubulk, struct file *file, u32 *read_flags);
+static int add_thread_read_cursor(struct usb_hdjbulk *ubulk, struct file *file);
+static int set_keyframe_interval(struct usb_hdjbulk *ubulk, struct file *file, u32 msecs);
+static int get_reader_stats(struct usb_hdjbulk *ubulk, struct file *file, 
+							struct dj_reader_stats *stats);
+
+/* the open list item hangs off the file from open until release */
+static inline struct hdj_open_list *open_list_from_file(struct file *file)
+{
+	return (struct hdj_open_list *)file->private_data;
+}
+
 static long hdjbulk_ioctl_entry(struct file *file,	
 								 unsigned int ioctl_num,	
 								 unsigned long ioctl_param)
@@ -98,7 +133,11 @@ static const struct file_operations hdjbulk_fops = {
 	.compat_ioctl = hdjbulk_ioctl_entry_compat,
 #endif
 	.read =		hdjbulk_read,
-	.poll =		hdjbulk_poll
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0) )
+	.read_iter =	hdjbulk_read_iter,
+#endif
+	.poll =		hdjbulk_poll,
+	.mmap =		hdjbulk_mmap
 };
 
 /*
@@ -534,12 +573,22 @@ static void output_control_callback(struct urb *urb/*, struct pt_regs *regs*/)
 	complete(com);
 }
 
-/* Sends output report already prepared in output_control_buffer, caller must synchronize with
- *  output_control_mutex */
-int usb_set_report(struct usb_hdjbulk *ubulk, u8 type, u8 id)
+/* Sends the report in output_report_buffer, caller must synchronize with output_report_mutex */
+static int send_output_report(struct usb_hdjbulk *ubulk, u8 type, u8 id)
 {
 	int rc;
-	
+
+	/* the worker is only scheduled once a token is available, so this normally does not wait,
+	 *  but synchronous callers may have to */
+	hdj_output_bucket_sleep(&ubulk->chip->output_bucket);
+
+	if (ubulk->chip->product_code==DJCONTROLSTEEL_PRODUCT_CODE) {
+		return send_bulk_write(ubulk,
+					ubulk->output_report_buffer,
+					ubulk->output_control_buffer_size,
+					0 /*force_send*/);
+	}
+
 	memset(ubulk->output_control_ctl_req,0,sizeof(*(ubulk->output_control_ctl_req)));
 	ubulk->output_control_ctl_req->bRequestType = USB_TYPE_CLASS | USB_RECIP_INTERFACE;
 	ubulk->output_control_ctl_req->bRequest = USB_REQ_SET_REPORT;
@@ -552,7 +601,7 @@ int usb_set_report(struct usb_hdjbulk *ubulk, u8 type, u8 id)
 				interface_to_usbdev(ubulk->control_interface),
 				usb_sndctrlpipe(interface_to_usbdev(ubulk->control_interface), 0),
 				(unsigned char *)ubulk->output_control_ctl_req,
-				ubulk->output_control_buffer,
+				ubulk->output_report_buffer,
 				ubulk->output_control_buffer_size,
 				output_control_callback,
 				&ubulk->output_control_completion);
@@ -563,11 +612,112 @@ int usb_set_report(struct usb_hdjbulk *ubulk, u8 type, u8 id)
 	} else {
 		wait_for_completion(&ubulk->output_control_completion);
 	}
-	/* some devices need this */
-	msleep(10);
+	return rc;
+}
+
+/* Sends output report already prepared in output_control_buffer, caller must synchronize with
+ *  output_control_mutex */
+int usb_set_report(struct usb_hdjbulk *ubulk, u8 type, u8 id)
+{
+	int rc;
+
+	/* this sends the whole shadow report, so nothing remains for the worker */
+	down(&ubulk->output_report_mutex);
+	memcpy(ubulk->output_report_buffer, ubulk->output_control_buffer, 
+			ubulk->output_control_buffer_size);
+	ubulk->output_report_dirty = 0;
+	rc = send_output_report(ubulk, type, id);
+	up(&ubulk->output_report_mutex);
 	return rc;
 } 
 
+/* 
+ * Sends the latest state of the shadow report.  Updates which were merged while the previous
+ *  report was in flight, or during the gap which follows it, go out as a single report.
+ */
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20) )
+static void output_report_work(struct work_struct *work)
+{
+	struct usb_hdjbulk *ubulk = container_of(work, struct usb_hdjbulk, output_report_work);
+#else
+static void output_report_work(void *data)
+{
+	struct usb_hdjbulk *ubulk = data;
+#endif
+	u64 wait;
+	int rc, retry;
+
+	down(&ubulk->output_control_mutex);
+	if (ubulk->output_report_dirty==0) {
+		up(&ubulk->output_control_mutex);
+		return;
+	}
+	down(&ubulk->output_report_mutex);
+	memcpy(ubulk->output_report_buffer, ubulk->output_control_buffer, 
+			ubulk->output_control_buffer_size);
+	ubulk->output_report_dirty = 0;
+	up(&ubulk->output_control_mutex);
+
+	/* the report ID is the first byte of the report */
+	rc = send_output_report(ubulk, USB_HID_OUTPUT_REPORT, ubulk->output_report_buffer[0]);
+	if (rc==0) {
+		ubulk->output_report_retries = 0;
+		up(&ubulk->output_report_mutex);
+		return;
+	}
+	retry = ubulk->output_report_retries < HDJ_OUTPUT_REPORT_RETRIES &&
+			can_send_urbs(ubulk->chip)==0;
+	if (retry) {
+		ubulk->output_report_retries++;
+	} else {
+		ubulk->output_report_retries = 0;
+	}
+	up(&ubulk->output_report_mutex);
+
+	printk(KERN_WARNING"%s() send_output_report() failed, rc:%d retry:%d\n",
+			__FUNCTION__,rc,retry);
+	/* Keep the update: it is retried, and goes out with the next one, or on resume, if the
+	 *  retries run out.  The caller of the next update learns of the failure. */
+	down(&ubulk->output_control_mutex);
+	ubulk->output_report_dirty = 1;
+	ubulk->output_report_error = rc;
+	if (retry) {
+		wait = hdj_output_bucket_wait_ns(&ubulk->chip->output_bucket);
+		if (wait < HDJ_OUTPUT_REPORT_RETRY_NS) {
+			wait = HDJ_OUTPUT_REPORT_RETRY_NS;
+		}
+		if (!hrtimer_active(&ubulk->output_report_timer)) {
+			hrtimer_start(&ubulk->output_report_timer, ns_to_ktime(wait), HRTIMER_MODE_REL);
+		}
+	}
+	up(&ubulk->output_control_mutex);
+}
+
+/* the output bucket has a token again */
+static enum hrtimer_restart output_report_timer(struct hrtimer *timer)
+{
+	struct usb_hdjbulk *ubulk = container_of(timer, struct usb_hdjbulk, output_report_timer);
+
+	schedule_work(&ubulk->output_report_work);
+	return HRTIMER_NORESTART;
+}
+
+/* Schedules the transfer of output_control_buffer, caller must synchronize with 
+ *  output_control_mutex */
+void queue_output_report(struct usb_hdjbulk *ubulk)
+{
+	u64 wait;
+
+	ubulk->output_report_dirty = 1;
+	/* if the worker is already scheduled, it will pick up this update as well */
+	wait = hdj_output_bucket_wait_ns(&ubulk->chip->output_bucket);
+	if (wait==0) {
+		schedule_work(&ubulk->output_report_work);
+	} else if (!hrtimer_active(&ubulk->output_report_timer)) {
+		hrtimer_start(&ubulk->output_report_timer, ns_to_ktime(wait), HRTIMER_MODE_REL);
+	}
+}
+
 long hdjbulk_ioctl(struct file *file,	
 					 unsigned int ioctl_num,	
 					 unsigned long ioctl_param,
@@ -598,8 +748,9 @@ long hdjbulk_ioctl(struct file *file,
 #endif
 	int __user * valueip_user;
 	struct hdj_steel_context* dc;
+	struct dj_reader_stats reader_stats;
 
-	chip_index = (int)(unsigned long)file->private_data;
+	chip_index = open_list_from_file(file)->chip_index;
 
 	/*increment the chip reference count for safety*/
 	chip = inc_chip_ref_count(chip_index);
@@ -1734,6 +1885,145 @@ long hdjbulk_ioctl(struct file *file,
 			result = -EFAULT;
 		}
 	break;
+	case DJ_IOCTL_GET_INPUT_RING_SIZE:
+		ioctl_trace_printk(KERN_INFO"%s() received IOCTL:  DJ_IOCTL_GET_INPUT_RING_SIZE\n",
+					__FUNCTION__);
+		if (is_continuous_reader_supported(chip)==0) {
+			result = -ENXIO;
+			break;
+		}
+		access = access_ok(VERIFY_WRITE,ioctl_param,sizeof(u32));
+		if (access) {
+			value32 = get_input_ring_map_size();
+			value32p_user = (u32 __user *)ioctl_param;
+			result = __put_user(value32, value32p_user);
+			if (result != 0) {
+				printk(KERN_WARNING"%s() ioctl received(), __put_user failed, result:%d\n",
+					__FUNCTION__,result);
+			}
+		} else {
+			printk(KERN_WARNING"%s() ioctl access_ok failed\n",__FUNCTION__);
+			result = -EFAULT;
+		}
+	break;
+	case DJ_IOCTL_SET_READ_FLAGS:
+		ioctl_trace_printk(KERN_INFO"%s() received IOCTL:  DJ_IOCTL_SET_READ_FLAGS\n",
+					__FUNCTION__);
+		access = access_ok(VERIFY_READ,ioctl_param,sizeof(u32));
+		if (access) {
+			value32p_user = (u32 __user *)ioctl_param;
+			result = __get_user(value32, value32p_user);
+			if (result != 0) {
+				printk(KERN_WARNING"%s() ioctl received(), __get_user failed, result:%d\n",
+					__FUNCTION__,result);
+				break;
+			}
+			result = set_read_flags(ubulk, file, value32);
+		} else {
+			printk(KERN_WARNING"%s() ioctl access_ok failed\n",__FUNCTION__);
+			result = -EFAULT;
+		}
+	break;
+	case DJ_IOCTL_GET_READ_FLAGS:
+		ioctl_trace_printk(KERN_INFO"%s() received IOCTL:  DJ_IOCTL_GET_READ_FLAGS\n",
+					__FUNCTION__);
+		access = access_ok(VERIFY_WRITE,ioctl_param,sizeof(u32));
+		if (access) {
+			result = get_read_flags(ubulk, file, &value32);
+			if (result==0) {
+				value32p_user = (u32 __user *)ioctl_param;
+				result = __put_user(value32, value32p_user);
+				if (result != 0) {
+					printk(KERN_WARNING"%s() ioctl received(), __put_user failed, result:%d\n",
+						__FUNCTION__,result);
+				}
+			}
+		} else {
+			printk(KERN_WARNING"%s() ioctl access_ok failed\n",__FUNCTION__);
+			result = -EFAULT;
+		}
+	break;
+	case DJ_IOCTL_SET_INPUT_URB_COUNT:
+		ioctl_trace_printk(KERN_INFO"%s() received IOCTL:  DJ_IOCTL_SET_INPUT_URB_COUNT\n",
+					__FUNCTION__);
+		access = access_ok(VERIFY_READ,ioctl_param,sizeof(u32));
+		if (access) {
+			value32p_user = (u32 __user *)ioctl_param;
+			result = __get_user(value32, value32p_user);
+			if (result != 0) {
+				printk(KERN_WARNING"%s() ioctl received(), __get_user failed, result:%d\n",
+					__FUNCTION__,result);
+				break;
+			}
+			if (value32 > DJ_POLL_INPUT_URB_COUNT_MAX) {
+				result = -EINVAL;
+				break;
+			}
+			result = set_continuous_reader_urb_count(ubulk, (int)value32);
+		} else {
+			printk(KERN_WARNING"%s() ioctl access_ok failed\n",__FUNCTION__);
+			result = -EFAULT;
+		}
+	break;
+	case DJ_IOCTL_GET_INPUT_URB_COUNT:
+		ioctl_trace_printk(KERN_INFO"%s() received IOCTL:  DJ_IOCTL_GET_INPUT_URB_COUNT\n",
+					__FUNCTION__);
+		access = access_ok(VERIFY_WRITE,ioctl_param,sizeof(u32));
+		if (access) {
+			result = get_continuous_reader_urb_count(ubulk);
+			if (result < 0) {
+				break;
+			}
+			value32 = (u32)result;
+			value32p_user = (u32 __user *)ioctl_param;
+			result = __put_user(value32, value32p_user);
+			if (result != 0) {
+				printk(KERN_WARNING"%s() ioctl received(), __put_user failed, result:%d\n",
+					__FUNCTION__,result);
+			}
+		} else {
+			printk(KERN_WARNING"%s() ioctl access_ok failed\n",__FUNCTION__);
+			result = -EFAULT;
+		}
+	break;
+	case DJ_IOCTL_SET_KEYFRAME_INTERVAL:
+		ioctl_trace_printk(KERN_INFO"%s() received IOCTL:  DJ_IOCTL_SET_KEYFRAME_INTERVAL\n",
+					__FUNCTION__);
+		access = access_ok(VERIFY_READ,ioctl_param,sizeof(u32));
+		if (access) {
+			value32p_user = (u32 __user *)ioctl_param;
+			result = __get_user(value32, value32p_user);
+			if (result != 0) {
+				printk(KERN_WARNING"%s() ioctl received(), __get_user failed, result:%d\n",
+					__FUNCTION__,result);
+				break;
+			}
+			result = set_keyframe_interval(ubulk, file, value32);
+		} else {
+			printk(KERN_WARNING"%s() ioctl access_ok failed\n",__FUNCTION__);
+			result = -EFAULT;
+		}
+	break;
+	case DJ_IOCTL_GET_READER_STATS:
+		ioctl_trace_printk(KERN_INFO"%s() received IOCTL:  DJ_IOCTL_GET_READER_STATS\n",
+					__FUNCTION__);
+		result = get_reader_stats(ubulk, file, &reader_stats);
+		if (result != 0) {
+			break;
+		}
+		ctouser = copy_to_user((void __user *)ioctl_param,&reader_stats,sizeof(reader_stats));
+		if (ctouser != 0) {
+			printk(KERN_WARNING"%s() ioctl received(), copy_to_user failed, ctouser:%lu\n",
+				__FUNCTION__,
+				ctouser);
+			result = -EFAULT;
+		}
+	break;
+	case DJ_IOCTL_ADD_READ_CURSOR:
+		ioctl_trace_printk(KERN_INFO"%s() received IOCTL:  DJ_IOCTL_ADD_READ_CURSOR\n",
+					__FUNCTION__);
+		result = add_thread_read_cursor(ubulk, file);
+	break;
 	case DJ_IOCTL_GET_CONTROL_DATA_OUTPUT_PACKET_SIZE:
 		ioctl_trace_printk(KERN_INFO"%s() received IOCTL:  DJ_IOCTL_GET_CONTROL_DATA_OUTPUT_PACKET_SIZE\n",
 					__FUNCTION__);
@@ -1757,6 +2047,29 @@ long hdjbulk_ioctl(struct file *file,
 			result = -EFAULT;
 		}
 	break;
+	case DJ_IOCTL_GET_OUTPUT_SHADOW_SIZE:
+		ioctl_trace_printk(KERN_INFO"%s() received IOCTL:  DJ_IOCTL_GET_OUTPUT_SHADOW_SIZE\n",
+					__FUNCTION__);
+		access = access_ok(VERIFY_WRITE,ioctl_param,sizeof(u32));
+		if (access) {
+			result = get_output_shadow_map_size(chip,&value32);
+			if (result==0) {
+				value32p_user = (u32 __user *)ioctl_param;
+				result = __put_user(value32, value32p_user);
+				if (result != 0) {
+					printk(KERN_WARNING"%s() ioctl received(), __put_user failed, result:%d\n",
+						__FUNCTION__,
+						result);
+				}
+			} else {
+				printk(KERN_WARNING"%s() get_output_shadow_map_size() failed, rc:%d\n",
+						__FUNCTION__, result);
+			}
+		} else {
+			printk(KERN_WARNING"%s() ioctl access_ok failed\n",__FUNCTION__);
+			result = -EFAULT;
+		}
+	break;
 	case DJ_IOCTL_SET_OUTPUT_CONTROL_DATA:
 #ifdef CONFIG_COMPAT
 	case DJ_IOCTL_SET_OUTPUT_CONTROL_DATA32:
@@ -1812,6 +2125,23 @@ long hdjbulk_ioctl(struct file *file,
 			result = -EFAULT;
 		}
 	break;
+	case DJ_IOCTL_SET_OUTPUT_CONTROL_VECTOR:
+#ifdef CONFIG_COMPAT
+	case DJ_IOCTL_SET_OUTPUT_CONTROL_VECTOR32:
+#endif
+		if (compat_mode==0) {
+			ioctl_trace_printk(KERN_INFO"%s() received IOCTL:  DJ_IOCTL_SET_OUTPUT_CONTROL_VECTOR\n",
+					__FUNCTION__);
+		} else {
+			ioctl_trace_printk(KERN_INFO"%s() received IOCTL:  DJ_IOCTL_SET_OUTPUT_CONTROL_VECTOR32\n",
+					__FUNCTION__);
+		}
+		result = send_control_output_vector(chip, (void __user *)ioctl_param);
+		if (result!=0) {
+			printk(KERN_WARNING"%s() send_control_output_vector failed(), rc:%d\n",
+				__FUNCTION__,result);
+		}
+	break;
 	case DJ_IOCTL_GET_OUTPUT_CONTROL_DATA:
 #ifdef CONFIG_COMPAT
 	case DJ_IOCTL_GET_OUTPUT_CONTROL_DATA32:
@@ -1891,118 +2221,375 @@ long hdjbulk_ioctl(struct file *file,
 	return result;
 }
 
-/* ALERT: read_list_lock needs to be acquired before calling */
-static void free_open_list(struct list_head *open_list, struct file * file)
+/* allocates the shared input ring the first time a client maps it */
+static int alloc_input_ring(struct usb_hdjbulk *ubulk)
+{
+	struct dj_input_ring_header *ring;
+	unsigned long flags;
+	int ret = 0;
+
+	down(&ubulk->input_ring_mutex);
+	if (ubulk->input_ring==NULL) {
+		/* vmalloc_user zeroes the memory */
+		ring = vmalloc_user(get_input_ring_map_size());
+		if (ring==NULL) {
+			printk(KERN_WARNING"%s() vmalloc_user failed\n",__FUNCTION__);
+			ret = -ENOMEM;
+		} else {
+			ring->version = DJ_INPUT_RING_VERSION;
+			ring->header_size = sizeof(struct dj_input_ring_header);
+			ring->num_reports = DJ_INPUT_RING_NUM_REPORTS;
+			ring->report_size = DJ_INPUT_RING_REPORT_SIZE;
+			ring->packet_size = ubulk->continuous_reader_packet_size;
+
+			/* from now on the completion routine will fill the ring */
+			spin_lock_irqsave(&ubulk->read_list_lock, flags);
+			ubulk->input_ring_head = 0;
+			ubulk->input_ring = ring;
+			spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
+		}
+	}
+	up(&ubulk->input_ring_mutex);
+	return ret;
+}
+
+/* ALERT: read_list_lock needs to be acquired before calling, if the item was added to open_list */
+static void free_open_list_item(struct hdj_open_list *open_list_item)
 {
 	struct list_head *p_read_item;
 	struct list_head *next_read_item;
 	struct hdj_read_list * read_list_item;
 
-	struct list_head *p_open_item;
-	struct list_head *next_open_item;
-	struct hdj_open_list * open_list_item;
-
-	struct list_head *p_buffer_item;
-	struct list_head *next_buffer_item;
-	struct hdj_read_buffers* read_buffer_item = NULL;
+	/* free all cursors of the file */
+	if (!list_empty(&open_list_item->read_list)) {
+		list_for_each_safe(p_read_item, next_read_item, &open_list_item->read_list) {
+			read_list_item = list_entry(p_read_item, struct hdj_read_list, list);
 
-	/* free all elements of the list */
-	if (!list_empty(open_list)) {
-		list_for_each_safe(p_open_item,next_open_item,open_list) {
-			open_list_item = list_entry(p_open_item, struct hdj_open_list, list);
+			list_del(p_read_item);
+			kfree(read_list_item->events);
+			kfree(read_list_item->ring);
+			kfree(read_list_item);
+		}
+	}
 
-			/* free the list for the current file */
-			if (open_list_item->file == file) {
-				if (!list_empty(&open_list_item->read_list)) {
-					list_for_each_safe(p_read_item, next_read_item, &open_list_item->read_list) {
-						read_list_item = list_entry(p_read_item, struct hdj_read_list, list);
-						
-						if (!list_empty(&read_list_item->list_buffers)) 						{
-							list_for_each_safe(p_buffer_item, next_buffer_item, &read_list_item->list_buffers) {
-								read_buffer_item = list_entry(p_buffer_item, struct hdj_read_buffers, list);
-
-								list_del(p_buffer_item);
-								kfree(read_buffer_item);
-							}
-						}
+	list_del(&open_list_item->list);
+	kfree(open_list_item);
+}
 
-						list_del(p_read_item);
-						kfree(read_list_item);
-					}
-				}
+/* returns the reader ring depth requested through the module parameter, as a power of 2 */
+static unsigned long get_reader_ring_depth(void)
+{
+	unsigned long depth = HDJ_READ_RING_DEPTH_DEFAULT;
 
-				list_del(p_open_item);
-				kfree(open_list_item);
-			}
-		}
+	if (reader_queue_depth > 0) {
+		depth = reader_queue_depth;
 	}
+	if (depth < HDJ_READ_RING_DEPTH_MIN) {
+		depth = HDJ_READ_RING_DEPTH_MIN;
+	} else if (depth > HDJ_READ_RING_DEPTH_MAX) {
+		depth = HDJ_READ_RING_DEPTH_MAX;
+	}
+	return roundup_pow_of_two(depth);
 }
 
-/* ALERT: read_list_lock needs to be acquired before calling */
-static struct hdj_open_list * alloc_and_init_open_list_item(struct file *file) 
+static inline u8 * reader_ring_slot(struct hdj_read_list *read_list_item, unsigned long index)
 {
-	struct hdj_open_list * open_list_item = NULL;
-	open_list_item = zero_alloc(sizeof(struct hdj_open_list), GFP_ATOMIC);
-	if (open_list_item != NULL) {
-		open_list_item->access_count = 1;
-		open_list_item->file = file;
-		open_list_item->is_releasing = 0;
-		INIT_LIST_HEAD(&open_list_item->read_list);
-		/*printk(KERN_INFO"%s() adding element to read_list\n",__FUNCTION__);*/
-	}
-	return open_list_item;
+	return &read_list_item->ring[(index & read_list_item->ring_mask)*HDJ_READ_RING_SLOT_SIZE];
 }
 
-/* ALERT: read_list_lock needs to be acquired before calling */
-static int alloc_and_init_read_list_item(struct hdj_read_list** read_list_item, 
-										long current_thread_id)
+static inline unsigned long reader_ring_count(struct hdj_read_list *read_list_item)
 {
-	struct hdj_read_buffers* read_buffer_item = NULL;
-	int i = 0, rc = 0;
-	struct list_head *p_buffer_item;
-	struct list_head *next_buffer_item;
+	return hdj_read_once(read_list_item->ring_head) - hdj_read_once(read_list_item->ring_tail);
+}
 
-	if (read_list_item == NULL) {
-		printk(KERN_WARNING"%s() NULL read_list_item\n",__FUNCTION__);
-		return -EINVAL;
-	}
+/* 
+ * Producer side of the reader ring, called from the URB completion.  If the ring is full the 
+ *  oldest report is discarded.  Returns the number of reports queued after the insertion.
+ */
+static unsigned long reader_ring_produce(struct hdj_read_list *read_list_item, 
+										const struct dj_read_timestamp_header *stamp,
+										void * buffer, int size)
+{
+	unsigned long head = read_list_item->ring_head;
+	unsigned long tail = hdj_read_once(read_list_item->ring_tail);
+	u8 *slot;
 
-	/* create a new element for this thread */
-	*read_list_item = zero_alloc(sizeof(struct hdj_read_list), GFP_ATOMIC);
-	if (*read_list_item == NULL) {
-		printk(KERN_WARNING"%s() memory allocation failed.\n",__FUNCTION__);
-		return -ENOMEM;
-	}
-	init_completion(&((*read_list_item)->read_completion));
-	(*read_list_item)->thread_id = current_thread_id;
-	INIT_LIST_HEAD(&((*read_list_item)->list_buffers));
-	atomic_set(&((*read_list_item)->num_pending_waits),0);
-	for (i = 0; i < HDJ_READ_BUFFERS_COUNT; i++) {
-		read_buffer_item = zero_alloc(sizeof(struct hdj_read_buffers), GFP_ATOMIC);
-		if (read_buffer_item != NULL) {
-			read_buffer_item->is_ready = 0;
-			list_add_tail(&read_buffer_item->list,&((*read_list_item)->list_buffers));
-		} else {
-			printk(KERN_WARNING"%s failed to allocate buffer queue element number:%d\n",
-					__FUNCTION__,i);
-			rc = -ENOMEM;
-			break;
+	if (head - tail > read_list_item->ring_mask) {
+		/* full- if the consumer has just taken this report then the slot is free already */
+		if (cmpxchg(&read_list_item->ring_tail, tail, tail + 1) == tail) {
+			read_list_item->dropped++;
 		}
+		tail++;
 	}
 
-	/* cleanup */
-	if (rc!=0 && *read_list_item!=NULL) {
-		/* free any queued buffers, then free element */
-		if (!list_empty(&(*read_list_item)->list_buffers)) {
-			list_for_each_safe(p_buffer_item, next_buffer_item, &(*read_list_item)->list_buffers) {
-				read_buffer_item = list_entry(p_buffer_item, struct hdj_read_buffers, list);
-				list_del(p_buffer_item);
-				kfree(read_buffer_item);
-			}
-		}
-		kfree(*read_list_item);
+	/* copy the timestamp and the buffer, and pad the rest with zeros */
+	slot = reader_ring_slot(read_list_item, head);
+	memcpy(slot, stamp, sizeof(*stamp));
+	slot += sizeof(*stamp);
+	memcpy(slot, buffer, size);
+	memset(slot + size, 0, HDJ_POLL_INPUT_BUFFER_SIZE - size);
+
+	/* publish the report only once its contents are visible */
+	smp_wmb();
+	read_list_item->ring_head = head + 1;
+	return head + 1 - tail;
+}
+
+/* 
+ * Consumer side of the reader ring.  Copies up to max_count of the oldest reports to the 
+ *  staging buffer, each preceded by its timestamp if with_stamp is set, and returns the number
+ *  of reports copied, or 0 if the ring is empty.
+ */
+static int reader_ring_consume(struct hdj_read_list *read_list_item, 
+								u8 *buf, int size, unsigned long max_count,
+								int with_stamp)
+{
+	unsigned long tail, count, i;
+	unsigned long offset = 0;
+
+	/* the timestamp sits right before the report in the slot, so it is one copy either way */
+	if (with_stamp) {
+		size += sizeof(struct dj_read_timestamp_header);
+	} else {
+		offset = sizeof(struct dj_read_timestamp_header);
 	}
-	return rc;
+
+	do {
+		tail = hdj_read_once(read_list_item->ring_tail);
+		count = hdj_read_once(read_list_item->ring_head) - tail;
+		if (count == 0) {
+			return 0;
+		}
+		if (count > max_count) {
+			count = max_count;
+		}
+		if (count > read_list_item->ring_mask + 1) {
+			/* stale tail, the cmpxchg below will fail */
+			count = read_list_item->ring_mask + 1;
+		}
+		/* pairs with the smp_wmb() in reader_ring_produce() */
+		smp_rmb();
+		for (i = 0; i < count; i++) {
+			memcpy(buf + i*size, reader_ring_slot(read_list_item, tail + i) + offset, size);
+		}
+		/* if the producer discarded any of these reports while we were copying them, the
+		 *  copy may be torn, so retry from the new oldest report */
+	} while (cmpxchg(&read_list_item->ring_tail, tail, tail + count) != tail);
+
+	atomic_long_add(count, &read_list_item->delivered);
+	return count;
+}
+
+static inline unsigned long event_ring_count(struct hdj_read_list *read_list_item)
+{
+	return hdj_read_once(read_list_item->event_head) - hdj_read_once(read_list_item->event_tail);
+}
+
+/* 
+ * Producer side of the event ring, with the same overrun handling as reader_ring_produce().  
+ *  Returns the number of events queued after the insertion.
+ */
+static unsigned long event_ring_produce(struct hdj_read_list *read_list_item,
+										const struct dj_control_event *events, int num_events)
+{
+	unsigned long head = read_list_item->event_head;
+	unsigned long tail = hdj_read_once(read_list_item->event_tail);
+	int i;
+
+	for (i = 0; i < num_events; i++) {
+		if (head - tail > read_list_item->event_mask) {
+			if (cmpxchg(&read_list_item->event_tail, tail, tail + 1) == tail) {
+				read_list_item->dropped++;
+			}
+			tail++;
+		}
+		read_list_item->events[head & read_list_item->event_mask] = events[i];
+		head++;
+	}
+
+	/* publish the events only once their contents are visible */
+	smp_wmb();
+	read_list_item->event_head = head;
+	return head - tail;
+}
+
+/* 
+ * Consumer side of the event ring.  Copies up to max_count of the oldest events to the staging
+ *  buffer, and returns the number of events copied, or 0 if the ring is empty.
+ */
+static int event_ring_consume(struct hdj_read_list *read_list_item, 
+								u8 *buf, unsigned long max_count)
+{
+	unsigned long tail, count, first;
+	unsigned long size = sizeof(struct dj_control_event);
+
+	do {
+		tail = hdj_read_once(read_list_item->event_tail);
+		count = hdj_read_once(read_list_item->event_head) - tail;
+		if (count == 0) {
+			return 0;
+		}
+		if (count > max_count) {
+			count = max_count;
+		}
+		if (count > read_list_item->event_mask + 1) {
+			/* stale tail, the cmpxchg below will fail */
+			count = read_list_item->event_mask + 1;
+		}
+		/* pairs with the smp_wmb() in event_ring_produce() */
+		smp_rmb();
+		/* at most two copies, as the events may wrap around the end of the ring */
+		first = read_list_item->event_mask + 1 - (tail & read_list_item->event_mask);
+		if (first > count) {
+			first = count;
+		}
+		memcpy(buf, &read_list_item->events[tail & read_list_item->event_mask], first*size);
+		memcpy(buf + first*size, read_list_item->events, (count - first)*size);
+		/* retry if the producer discarded any of these events while we were copying them */
+	} while (cmpxchg(&read_list_item->event_tail, tail, tail + count) != tail);
+
+	atomic_long_add(count, &read_list_item->delivered);
+	return count;
+}
+
+/* 
+ * Keeps the newest report for readers in latest mode, in the same layout as a ring slot.
+ * ALERT: read_list_lock needs to be acquired before calling 
+ */
+static void store_latest_report(struct usb_hdjbulk *ubulk, 
+								const struct dj_read_timestamp_header *stamp,
+								void * buffer, unsigned long size)
+{
+	if (size > HDJ_POLL_INPUT_BUFFER_SIZE) {
+		size = HDJ_POLL_INPUT_BUFFER_SIZE;
+	}
+	write_seqcount_begin(&ubulk->latest_report_seq);
+	memcpy(ubulk->latest_report, stamp, sizeof(*stamp));
+	memcpy(ubulk->latest_report + sizeof(*stamp), buffer, size);
+	memset(ubulk->latest_report + sizeof(*stamp) + size, 0, HDJ_POLL_INPUT_BUFFER_SIZE - size);
+	ubulk->latest_report_count++;
+	write_seqcount_end(&ubulk->latest_report_seq);
+}
+
+/* 
+ * Copies the newest report to the staging buffer if this reader has not seen it yet.  Returns 1
+ *  if a report was copied, or 0 if there is nothing new.
+ */
+static int read_latest_report(struct usb_hdjbulk *ubulk, struct hdj_read_list *read_list_item,
+								u8 *buf, int size, int with_stamp)
+{
+	u8 report[HDJ_READ_RING_SLOT_SIZE];
+	unsigned long count;
+	unsigned long offset = 0;
+	unsigned seq;
+
+	do {
+		seq = read_seqcount_begin(&ubulk->latest_report_seq);
+		count = ubulk->latest_report_count;
+		if (count == read_list_item->latest_seen) {
+			return 0;
+		}
+		memcpy(report, ubulk->latest_report, sizeof(report));
+	} while (read_seqcount_retry(&ubulk->latest_report_seq, seq));
+
+	if (with_stamp) {
+		size += sizeof(struct dj_read_timestamp_header);
+	} else {
+		offset = sizeof(struct dj_read_timestamp_header);
+	}
+	memcpy(buf, report + offset, size);
+	read_list_item->latest_seen = count;
+	atomic_long_inc(&read_list_item->delivered);
+	return 1;
+}
+
+/* returns non zero if a read by this reader would not block */
+static inline int reader_has_data(struct usb_hdjbulk *ubulk, 
+								struct hdj_read_list *read_list_item, u32 read_flags)
+{
+	if (read_flags & DJ_READ_FLAG_LATEST) {
+		return hdj_read_once(ubulk->latest_report_count) != read_list_item->latest_seen;
+	}
+	if (read_flags & DJ_READ_FLAG_EVENTS) {
+		return event_ring_count(read_list_item) != 0;
+	}
+	return reader_ring_count(read_list_item) != 0;
+}
+
+static int alloc_and_init_read_list_item(struct hdj_read_list** read_list_item, 
+										long thread_id, int with_events, gfp_t gfp)
+{
+	unsigned long depth;
+
+	if (read_list_item == NULL) {
+		printk(KERN_WARNING"%s() NULL read_list_item\n",__FUNCTION__);
+		return -EINVAL;
+	}
+
+	*read_list_item = zero_alloc(sizeof(struct hdj_read_list), gfp);
+	if (*read_list_item == NULL) {
+		printk(KERN_WARNING"%s() memory allocation failed.\n",__FUNCTION__);
+		return -ENOMEM;
+	}
+	init_waitqueue_head(&((*read_list_item)->read_wait));
+	(*read_list_item)->thread_id = thread_id;
+
+	depth = get_reader_ring_depth();
+	(*read_list_item)->ring = zero_alloc(depth*HDJ_READ_RING_SLOT_SIZE, gfp);
+	if ((*read_list_item)->ring == NULL) {
+		printk(KERN_WARNING"%s failed to allocate ring of depth:%lu\n",
+				__FUNCTION__,depth);
+		kfree(*read_list_item);
+		*read_list_item = NULL;
+		return -ENOMEM;
+	}
+	(*read_list_item)->ring_mask = depth - 1;
+	(*read_list_item)->ring_head = 0;
+	(*read_list_item)->ring_tail = 0;
+
+	/* only once the file reads events, see alloc_event_rings() */
+	if (with_events) {
+		(*read_list_item)->events = zero_alloc(HDJ_EVENT_RING_DEPTH*
+										sizeof(struct dj_control_event), gfp);
+		if ((*read_list_item)->events == NULL) {
+			printk(KERN_WARNING"%s failed to allocate event ring\n",__FUNCTION__);
+			kfree((*read_list_item)->ring);
+			kfree(*read_list_item);
+			*read_list_item = NULL;
+			return -ENOMEM;
+		}
+		(*read_list_item)->event_mask = HDJ_EVENT_RING_DEPTH - 1;
+	}
+	return 0;
+}
+
+/* 
+ * Allocates the state of a file at open.  The file's own cursor is created here as well if the
+ *  product has a continuous reader, so that read and poll never need to allocate.
+ */
+static struct hdj_open_list * alloc_and_init_open_list_item(struct file *file, int chip_index,
+															int with_reader) 
+{
+	struct hdj_open_list * open_list_item = NULL;
+	open_list_item = zero_alloc(sizeof(struct hdj_open_list), GFP_KERNEL);
+	if (open_list_item != NULL) {
+		open_list_item->access_count = 1;
+		open_list_item->file = file;
+		open_list_item->chip_index = chip_index;
+		open_list_item->is_releasing = 0;
+		INIT_LIST_HEAD(&open_list_item->list);
+		INIT_LIST_HEAD(&open_list_item->read_list);
+		if (with_reader) {
+			if (alloc_and_init_read_list_item(&open_list_item->reader, 0, 
+											0, GFP_KERNEL)!=0) {
+				kfree(open_list_item);
+				return NULL;
+			}
+			list_add_tail(&open_list_item->reader->list,&open_list_item->read_list);
+		}
+		/*printk(KERN_INFO"%s() adding element to read_list\n",__FUNCTION__);*/
+	}
+	return open_list_item;
 }
 
 /* ALERT: read_list_lock needs to be acquired before calling */
@@ -2023,24 +2610,282 @@ static struct hdj_read_list *get_read_list_element(struct list_head *read_list,
 	return NULL;
 }
 
+/* 
+ * Returns the cursor which the calling thread reads from- its own if it added one, otherwise
+ *  the file's.
+ * ALERT: read_list_lock needs to be acquired before calling 
+ */
+static struct hdj_read_list *get_reader(struct hdj_open_list *open_list_item)
+{
+	struct hdj_read_list *read_list_item;
+
+	if (open_list_item->num_thread_cursors!=0) {
+		read_list_item = get_read_list_element(&open_list_item->read_list, current->pid);
+		if (read_list_item!=NULL) {
+			return read_list_item;
+		}
+	}
+	return open_list_item->reader;
+}
+
 /* ALERT: read_list_lock needs to be acquired before calling */
-static struct hdj_open_list *get_open_list_element(struct list_head *open_list, 
-													struct file * file)
+static struct hdj_read_list *get_cursor_without_events(struct hdj_open_list *open_list_item)
 {
+	struct list_head *p_read_item;
+	struct list_head *next_read_item;
+	struct hdj_read_list * read_list_item;
+
+	list_for_each_safe(p_read_item, next_read_item, &open_list_item->read_list) {
+		read_list_item = list_entry(p_read_item, struct hdj_read_list, list);
+		if (read_list_item->events == NULL) {
+			return read_list_item;
+		}
+	}
+	return NULL;
+}
+
+/* 
+ * Event rings are only allocated once a file asks for events, and then kept until release.
+ *  This gives every cursor of the file one.  Cursors are only freed with the file, so they 
+ *  outlive the caller's ioctl.
+ */
+static int alloc_event_rings(struct usb_hdjbulk *ubulk, struct hdj_open_list *open_list_item)
+{
+	struct hdj_read_list *read_list_item;
+	struct dj_control_event *events;
+	unsigned long flags;
+
+	for (;;) {
+		spin_lock_irqsave(&ubulk->read_list_lock, flags);
+		read_list_item = get_cursor_without_events(open_list_item);
+		spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
+		if (read_list_item == NULL) {
+			return 0;
+		}
+
+		events = zero_alloc(HDJ_EVENT_RING_DEPTH*sizeof(struct dj_control_event), GFP_KERNEL);
+		if (events == NULL) {
+			printk(KERN_WARNING"%s failed to allocate event ring\n",__FUNCTION__);
+			return -ENOMEM;
+		}
+
+		spin_lock_irqsave(&ubulk->read_list_lock, flags);
+		if (read_list_item->events == NULL) {
+			read_list_item->events = events;
+			read_list_item->event_mask = HDJ_EVENT_RING_DEPTH - 1;
+			events = NULL;
+		}
+		spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
+		if (events != NULL) {
+			kfree(events);
+		}
+	}
+}
+
+static int set_read_flags(struct usb_hdjbulk *ubulk, struct file *file, u32 read_flags)
+{
+	struct hdj_open_list* open_list_item;
+	unsigned long flags;
+	int ret;
+
+	if (is_continuous_reader_supported(ubulk->chip)==0) {
+		return -ENXIO;
+	}
+
+	if ((read_flags & ~DJ_READ_FLAGS_ALL)!=0) {
+		printk(KERN_WARNING"%s() invalid read flags:0x%x\n",__FUNCTION__,read_flags);
+		return -EINVAL;
+	}
+
+	/* the batch header only describes batches, latest mode reads a single report which is
+	 *  never queued, and events have a format of their own */
+	if (((read_flags & DJ_READ_FLAG_EVENTS)!=0 && read_flags!=DJ_READ_FLAG_EVENTS) ||
+	    ((read_flags & DJ_READ_FLAG_BATCH_HEADER)!=0 && (read_flags & DJ_READ_FLAG_BATCH)==0) ||
+	    ((read_flags & DJ_READ_FLAG_LATEST)!=0 && 
+	     (read_flags & ~(DJ_READ_FLAG_LATEST | DJ_READ_FLAG_TIMESTAMP))!=0)) {
+		printk(KERN_WARNING"%s() unsupported read flags combination:0x%x\n",
+				__FUNCTION__,read_flags);
+		return -EINVAL;
+	}
+
+	/* events are decoded with the product's control table */
+	if ((read_flags & DJ_READ_FLAG_EVENTS)!=0 && ubulk->num_input_controls==0) {
+		printk(KERN_WARNING"%s() no control table for product:%d\n",
+				__FUNCTION__,ubulk->chip->product_code);
+		return -ENXIO;
+	}
+
+	open_list_item = open_list_from_file(file);
+	for (;;) {
+		if (read_flags & DJ_READ_FLAG_EVENTS) {
+			ret = alloc_event_rings(ubulk, open_list_item);
+			if (ret!=0) {
+				return ret;
+			}
+		}
+		spin_lock_irqsave(&ubulk->read_list_lock, flags);
+		/* a thread may have added a cursor since, which the flags must not reach first */
+		if ((read_flags & DJ_READ_FLAG_EVENTS)==0 || 
+		    get_cursor_without_events(open_list_item)==NULL) {
+			break;
+		}
+		spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
+	}
+	open_list_item->read_flags = read_flags;
+	spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
+	return 0;
+}
+
+static int get_read_flags(struct usb_hdjbulk *ubulk, struct file *file, u32 *read_flags)
+{
+	struct hdj_open_list* open_list_item;
+	unsigned long flags;
+
+	if (is_continuous_reader_supported(ubulk->chip)==0) {
+		return -ENXIO;
+	}
+
+	open_list_item = open_list_from_file(file);
+	spin_lock_irqsave(&ubulk->read_list_lock, flags);
+	*read_flags = open_list_item->read_flags;
+	spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
+	return 0;
+}
+
+static int set_keyframe_interval(struct usb_hdjbulk *ubulk, struct file *file, u32 msecs)
+{
+	struct hdj_open_list* open_list_item;
+	unsigned long flags;
+
+	if (is_continuous_reader_supported(ubulk->chip)==0) {
+		return -ENXIO;
+	}
+
+	open_list_item = open_list_from_file(file);
+	spin_lock_irqsave(&ubulk->read_list_lock, flags);
+	open_list_item->keyframe_interval = msecs_to_jiffies(msecs);
+	spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
+	return 0;
+}
+
+static void get_device_input_totals(struct usb_hdjbulk *ubulk, struct dj_reader_stats *stats)
+{
+	stats->urb_errors = atomic_long_read(&ubulk->urb_errors);
+	stats->urb_sequence_gaps = atomic_long_read(&ubulk->urb_sequence_gaps);
+	stats->device_sequence_gaps = atomic_long_read(&ubulk->device_sequence_gaps);
+}
+
+static int get_reader_stats(struct usb_hdjbulk *ubulk, struct file *file, 
+							struct dj_reader_stats *stats)
+{
+	struct hdj_open_list* open_list_item;
+	struct hdj_read_list* read_list_item;
+	unsigned long flags;
+
+	if (is_continuous_reader_supported(ubulk->chip)==0) {
+		return -ENXIO;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	open_list_item = open_list_from_file(file);
+	spin_lock_irqsave(&ubulk->read_list_lock, flags);
+	read_list_item = get_reader(open_list_item);
+	stats->queued = read_list_item->queued;
+	stats->delivered = atomic_long_read(&read_list_item->delivered);
+	stats->dropped = read_list_item->dropped;
+	stats->max_depth = read_list_item->max_depth;
+	stats->queue_size = read_list_item->ring_mask + 1;
+	spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
+
+	get_device_input_totals(ubulk, stats);
+	return 0;
+}
+
+/* 
+ * Sums the statistics of every reader of the device, max_depth being the largest of them, and
+ *  adds the device totals.
+ */
+int get_input_stats_totals(struct usb_hdjbulk *ubulk, struct dj_reader_stats *stats, 
+							u32 *num_readers)
+{
+	struct list_head *p_read_item;
+	struct hdj_read_list * read_list_item;
 	struct list_head *p_open_item;
-	struct list_head *next_open_item;
 	struct hdj_open_list * open_list_item;
+	unsigned long flags;
 
-	if (!list_empty(open_list))
-	{
-		list_for_each_safe(p_open_item,next_open_item,open_list) {
-			open_list_item = list_entry(p_open_item, struct hdj_open_list, list);
-			if (open_list_item->file == file) {
-				return open_list_item;
+	if (is_continuous_reader_supported(ubulk->chip)==0) {
+		return -ENXIO;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	*num_readers = 0;
+	spin_lock_irqsave(&ubulk->read_list_lock, flags);
+	list_for_each(p_open_item, &ubulk->open_list) {
+		open_list_item = list_entry(p_open_item, struct hdj_open_list, list);
+		list_for_each(p_read_item, &open_list_item->read_list) {
+			read_list_item = list_entry(p_read_item, struct hdj_read_list, list);
+			stats->queued += read_list_item->queued;
+			stats->delivered += atomic_long_read(&read_list_item->delivered);
+			stats->dropped += read_list_item->dropped;
+			if (read_list_item->max_depth > stats->max_depth) {
+				stats->max_depth = read_list_item->max_depth;
 			}
+			++(*num_readers);
 		}
 	}
-	return NULL;
+	spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
+
+	get_device_input_totals(ubulk, stats);
+	return 0;
+}
+
+static int add_thread_read_cursor(struct usb_hdjbulk *ubulk, struct file *file)
+{
+	struct hdj_open_list* open_list_item;
+	struct hdj_read_list* read_list_item = NULL;
+	unsigned long flags;
+	int ret, need_events = 0;
+
+	if (is_continuous_reader_supported(ubulk->chip)==0) {
+		return -ENXIO;
+	}
+
+	open_list_item = open_list_from_file(file);
+	ret = alloc_and_init_read_list_item(&read_list_item, current->pid, 
+						(hdj_read_once(open_list_item->read_flags) & DJ_READ_FLAG_EVENTS)!=0,
+						GFP_KERNEL);
+	if (ret!=0) {
+		printk(KERN_WARNING"%s() alloc_and_init_read_list_item failed.\n",__FUNCTION__);
+		return ret;
+	}
+
+	spin_lock_irqsave(&ubulk->read_list_lock, flags);
+	if (open_list_item->is_releasing) {
+		ret = -ENODEV;
+	} else if (get_read_list_element(&open_list_item->read_list, current->pid)!=NULL) {
+		/* this thread already has its own cursor */
+		ret = -EEXIST;
+	} else {
+		list_add_tail(&read_list_item->list,&open_list_item->read_list);
+		++open_list_item->num_thread_cursors;
+		/* the file may have started reading events since we allocated */
+		need_events = (open_list_item->read_flags & DJ_READ_FLAG_EVENTS)!=0 &&
+						read_list_item->events==NULL;
+		read_list_item = NULL;
+	}
+	spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
+
+	if (need_events) {
+		ret = alloc_event_rings(ubulk, open_list_item);
+	}
+
+	if (read_list_item!=NULL) {
+		kfree(read_list_item->events);
+		kfree(read_list_item->ring);
+		kfree(read_list_item);
+	}
+	return ret;
 }
 
 int hdjbulk_open(struct inode *inode, struct file *file)
@@ -2051,7 +2896,7 @@ int hdjbulk_open(struct inode *inode, struct file *file)
 	struct usb_interface *interface;
 	int subminor;
 	unsigned long flags;
-	struct hdj_open_list * open_list_item;
+	struct hdj_open_list * open_list_item = NULL;
 	int retval = 0;
 
 	subminor = iminor(inode);
@@ -2095,6 +2940,15 @@ int hdjbulk_open(struct inode *inode, struct file *file)
 		goto exit;
 	}
 
+	/* the per file state, which also tells the other entry points our object's index */
+	open_list_item = alloc_and_init_open_list_item(file, chip_index,
+						is_continuous_reader_supported(ubulk->chip));
+	if (open_list_item==NULL) {
+		printk(KERN_WARNING"%s alloc_and_init_open_list_item() failed, bailing\n", __FUNCTION__);
+		retval = -ENOMEM;
+		goto exit;
+	}
+
 #if ( LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19) )
 	if (1==atomic_inc_return(&ubulk->open_count)) {
 		retval = usb_autopm_get_interface(interface);
@@ -2109,27 +2963,27 @@ int hdjbulk_open(struct inode *inode, struct file *file)
 	} */
 #endif
 
-	/* save our object's index in the file's private structure */
-	file->private_data = (void*)(unsigned long)ubulk->chip->index;
+	file->private_data = open_list_item;
+
+#ifdef FMODE_NOWAIT
+	/* read_iter honours IOCB_NOWAIT, so io_uring need not punt reads to a worker */
+	file->f_mode |= FMODE_NOWAIT;
+#endif
 
 	if (is_continuous_reader_supported(ubulk->chip)==1) {
 		spin_lock_irqsave(&ubulk->read_list_lock, flags);
 		if (list_empty(&ubulk->open_list)) {
 			buffer_queue_depth=0;
 		}
-		if (get_open_list_element(&ubulk->open_list, file) == NULL) {
-			open_list_item = alloc_and_init_open_list_item(file);
-			if (open_list_item!=NULL) {
-				list_add_tail(&open_list_item->list,&ubulk->open_list);
-			} else {
-				printk(KERN_WARNING"%s init_open_queue_item() failed, bailing\n", __FUNCTION__);
-				retval = -ENOMEM;
-			}
-		}
+		list_add_tail(&open_list_item->list,&ubulk->open_list);
 		spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
 	} 
 
 exit:
+	if (retval!=0 && open_list_item!=NULL) {
+		/* not yet visible to the completion routine */
+		free_open_list_item(open_list_item);
+	}
 	if (chip) {
 		dec_chip_ref_count(chip_index);
 
@@ -2163,15 +3017,404 @@ void signal_all_waiting_readers(struct list_head *open_list)
 			if (!list_empty(&open_list_item->read_list)) {
 				list_for_each_safe(p_read_item, next_read_item, &open_list_item->read_list) {
 					read_list_item = list_entry(p_read_item, struct hdj_read_list, list);
-					complete(&read_list_item->read_completion);
+					wake_up_interruptible(&read_list_item->read_wait);
 				}
 			}
 		}
 	}
 }
 
-/* ALERT: read_list_lock needs to be acquired before calling */
-static void fill_queued_buffers(struct list_head *open_list, void * buffer, unsigned long size)
+/* 
+ * Input control tables for DJ_READ_FLAG_EVENTS, one per product, in the manner of the MP3's
+ *  mp3_input_control_details.  The HID consoles share the MP3's layout: report ID, button bits
+ *  in bytes 1 to 4, then knobs and faders, pitch and jog wheels, and the mouse.  The Mk2 has its
+ *  headphone monitor selector in the low nibble of byte 5, see hdjmk2_hm_fwfix().  The DJ 
+ *  Control Steel reports its FX and mode shift state as flags, and its firmware version, serial
+ *  number, MIDI channel and sequence bytes are left out, as they are not controls.
+ */
+#define HDJ_BUTTON(byte,bit)	{ DJ_CONTROL_ID(byte,bit), DJ_CONTROL_TYPE_BUTTON, byte, 1, bit, 0 }
+#define HDJ_FLAG(byte,bit)		{ DJ_CONTROL_ID(byte,bit), DJ_CONTROL_TYPE_FLAG, byte, 1, bit, 0 }
+#define HDJ_ABSOLUTE(byte)		{ DJ_CONTROL_ID(byte,0), DJ_CONTROL_TYPE_ABSOLUTE, byte, 1, 0, 0 }
+#define HDJ_RELATIVE(byte)		{ DJ_CONTROL_ID(byte,0), DJ_CONTROL_TYPE_RELATIVE, byte, 1, 0, 0 }
+#define HDJ_BYTE_RUN(type,first,count)	{ DJ_CONTROL_ID(first,0), type, first, count, 0, 0 }
+#define HDJ_BUTTON_BYTE(byte)	HDJ_BUTTON(byte,0), HDJ_BUTTON(byte,1), HDJ_BUTTON(byte,2), \
+								HDJ_BUTTON(byte,3), HDJ_BUTTON(byte,4), HDJ_BUTTON(byte,5), \
+								HDJ_BUTTON(byte,6), HDJ_BUTTON(byte,7)
+
+/* DJ Console and DJ Console Rmx */
+static const struct hdj_input_control djconsole_input_controls[] = {
+	HDJ_BUTTON_BYTE(1), HDJ_BUTTON_BYTE(2), HDJ_BUTTON_BYTE(3),
+	HDJ_BUTTON(4,0), HDJ_BUTTON(4,1), HDJ_BUTTON(4,2), HDJ_BUTTON(4,3),
+	HDJ_ABSOLUTE(5), HDJ_ABSOLUTE(6), HDJ_ABSOLUTE(7), HDJ_ABSOLUTE(8), HDJ_ABSOLUTE(9), 
+	HDJ_ABSOLUTE(10), HDJ_ABSOLUTE(11), HDJ_ABSOLUTE(12), HDJ_ABSOLUTE(13),
+	HDJ_RELATIVE(14), HDJ_RELATIVE(15), HDJ_RELATIVE(16), HDJ_RELATIVE(17),
+	HDJ_ABSOLUTE(18), HDJ_ABSOLUTE(19),
+};
+
+static const struct hdj_input_control djconsole2_input_controls[] = {
+	HDJ_BUTTON_BYTE(1), HDJ_BUTTON_BYTE(2), HDJ_BUTTON_BYTE(3),
+	HDJ_BUTTON(4,0), HDJ_BUTTON(4,1), HDJ_BUTTON(4,2), HDJ_BUTTON(4,3),
+	/* headphone monitor: deck A, deck B, split, mix */
+	HDJ_BUTTON(5,0), HDJ_BUTTON(5,1), HDJ_BUTTON(5,2), HDJ_BUTTON(5,3),
+	HDJ_ABSOLUTE(6), HDJ_ABSOLUTE(7), HDJ_ABSOLUTE(8), HDJ_ABSOLUTE(9), 
+	HDJ_ABSOLUTE(10), HDJ_ABSOLUTE(11), HDJ_ABSOLUTE(12), HDJ_ABSOLUTE(13),
+	HDJ_RELATIVE(14), HDJ_RELATIVE(15), HDJ_RELATIVE(16), HDJ_RELATIVE(17),
+	HDJ_ABSOLUTE(18), HDJ_ABSOLUTE(19),
+};
+
+static const struct hdj_input_control djsteel_input_controls[] = {
+	HDJ_BYTE_RUN(DJ_CONTROL_TYPE_BYTE, 0, DJ_STEEL_EP_81_FX_STATE_0),
+	/* FX: deck A and B, then master and lock, see DJ_IOCTL_GET_FX_STATE */
+	HDJ_FLAG(DJ_STEEL_EP_81_FX_STATE_0,6), HDJ_FLAG(DJ_STEEL_EP_81_FX_STATE_0,7),
+	HDJ_FLAG(DJ_STEEL_EP_81_FX_STATE_1,6), HDJ_FLAG(DJ_STEEL_EP_81_FX_STATE_1,7),
+	/* mode shift of deck B and A, see DJ_IOCTL_GET_MODE_SHIFT_STATE */
+	HDJ_FLAG(DJ_STEEL_EP_81_MODE_SHIFT_STATE,6), HDJ_FLAG(DJ_STEEL_EP_81_MODE_SHIFT_STATE,7),
+	HDJ_BYTE_RUN(DJ_CONTROL_TYPE_BYTE, DJ_STEEL_EP_81_MODE_SHIFT_STATE + 1, 
+		DJ_STEEL_EP_81_FIRMWARE_VERSION - DJ_STEEL_EP_81_MODE_SHIFT_STATE - 1),
+	HDJ_BYTE_RUN(DJ_CONTROL_TYPE_BYTE, DJ_STEEL_EP_81_SEQ_NUM + 1, 
+		DJ_STEEL_EP_81_JOG_WHEEL_SETTINGS_0 - DJ_STEEL_EP_81_SEQ_NUM - 1),
+	HDJ_BYTE_RUN(DJ_CONTROL_TYPE_STATE, DJ_STEEL_EP_81_JOG_WHEEL_SETTINGS_0, 
+		DJ_STEEL_EP_81_JOG_WHEEL_SETTINGS_1 - DJ_STEEL_EP_81_JOG_WHEEL_SETTINGS_0 + 1),
+	HDJ_BYTE_RUN(DJ_CONTROL_TYPE_BYTE, DJ_STEEL_EP_81_JOG_WHEEL_SETTINGS_1 + 1, 
+		HDJ_POLL_INPUT_BUFFER_SIZE - DJ_STEEL_EP_81_JOG_WHEEL_SETTINGS_1 - 1),
+};
+
+/* 
+ * Adds the input controls of a HID report descriptor to controls: every button bit, and every
+ *  8 or 16 bit field, absolute ones being faders and knobs and relative ones jog wheels.  
+ *  Padding, array fields and fields beyond report_len are skipped.  Push and pop items are not
+ *  used by our consoles.  Returns the number of controls.
+ */
+static int parse_hid_input_controls(const u8 *desc, int desc_len, unsigned long report_len,
+									struct hdj_input_control *controls)
+{
+	struct hdj_input_control *control;
+	unsigned long bit_offset = 0;
+	u32 report_size = 0, report_count = 0, data, j;
+	u8 report_id = 0;
+	u8 prefix;
+	int i, pos = 0, size, num_controls = 0;
+
+	while (pos < desc_len) {
+		prefix = desc[pos++];
+		if (prefix == HDJ_HID_ITEM_LONG) {
+			if (pos >= desc_len) {
+				break;
+			}
+			/* data size, long item tag, and the data */
+			pos += 2 + desc[pos];
+			continue;
+		}
+		size = prefix & 0x3;
+		if (size == 3) {
+			size = 4;
+		}
+		if (pos + size > desc_len) {
+			break;
+		}
+		data = 0;
+		for (i = 0; i < size; i++) {
+			data |= (u32)desc[pos + i] << (8*i);
+		}
+		pos += size;
+
+		switch (prefix & 0xfc) {
+		case HDJ_HID_ITEM_REPORT_SIZE:
+			report_size = data;
+			break;
+		case HDJ_HID_ITEM_REPORT_COUNT:
+			report_count = data;
+			break;
+		case HDJ_HID_ITEM_REPORT_ID:
+			/* the report ID takes the first byte of numbered reports */
+			report_id = data;
+			bit_offset = 8;
+			break;
+		case HDJ_HID_ITEM_INPUT:
+			for (j = 0; j < report_count; j++, bit_offset += report_size) {
+				if (bit_offset + report_size > report_len*8) {
+					break;
+				}
+				if ((data & HDJ_HID_INPUT_CONSTANT)!=0 || (data & HDJ_HID_INPUT_VARIABLE)==0) {
+					continue;
+				}
+				if (num_controls == HDJ_MAX_INPUT_CONTROLS) {
+					return num_controls;
+				}
+				control = &controls[num_controls];
+				if (report_size == 1) {
+					control->type = DJ_CONTROL_TYPE_BUTTON;
+					control->bit_number = bit_offset % 8;
+					control->num_bytes = 1;
+				} else if ((report_size == 8 || report_size == 16) && (bit_offset % 8)==0) {
+					if (data & HDJ_HID_INPUT_RELATIVE) {
+						control->type = DJ_CONTROL_TYPE_RELATIVE;
+					} else {
+						control->type = DJ_CONTROL_TYPE_ABSOLUTE;
+					}
+					control->bit_number = 0;
+					control->num_bytes = report_size / 8;
+				} else {
+					continue;
+				}
+				control->control_id = num_controls;
+				control->byte_number = bit_offset / 8;
+				control->report_id = report_id;
+				num_controls++;
+			}
+			break;
+		}
+	}
+	return num_controls;
+}
+
+/* returns 1 if the table holds a control of the same type at the same place */
+static int has_input_control(const struct hdj_input_control *controls, int num_controls, 
+								const struct hdj_input_control *control)
+{
+	int i;
+
+	for (i = 0; i < num_controls; i++) {
+		if (controls[i].type == control->type && 
+		    controls[i].byte_number == control->byte_number &&
+		    controls[i].num_bytes == control->num_bytes &&
+		    controls[i].bit_number == control->bit_number) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* 
+ * Cross-checks the control table of a HID console against the report descriptor of its polling
+ *  interface, and reports the first control on which they disagree.  The table is used either
+ *  way, this only flags a layout which the table does not describe.
+ */
+static void check_hid_input_controls(struct usb_hdjbulk *ubulk, struct usb_interface *interface,
+									int interface_number)
+{
+	struct usb_host_interface *interface_desc = interface->cur_altsetting;
+	unsigned char *extra = interface_desc->extra;
+	int extra_len = interface_desc->extralen;
+	struct hdj_input_control *hid_controls = NULL;
+	const struct hdj_input_control *control;
+	int desc_len = 0;
+	int i, num_controls, num_table_controls = 0, ret;
+	u8 *desc;
+
+	/* the HID class descriptor follows the interface descriptor, and gives the length of 
+	 *  the report descriptor */
+	while (extra_len >= 2 && extra[0] >= 2 && extra[0] <= extra_len) {
+		if (extra[1] == HDJ_DT_HID) {
+			for (i = 6; i + 2 < extra[0]; i += 3) {
+				if (extra[i] == HDJ_DT_HID_REPORT) {
+					desc_len = extra[i + 1] | (extra[i + 2] << 8);
+					break;
+				}
+			}
+			break;
+		}
+		extra_len -= extra[0];
+		extra += extra[0];
+	}
+	if (desc_len == 0 || desc_len > HDJ_HID_REPORT_DESC_MAX_LEN) {
+		printk(KERN_INFO"%s() no usable HID descriptor, report descriptor len:%d\n",
+				__FUNCTION__,desc_len);
+		return;
+	}
+
+	desc = kmalloc(desc_len, GFP_KERNEL);
+	hid_controls = kmalloc(HDJ_MAX_INPUT_CONTROLS*sizeof(struct hdj_input_control), GFP_KERNEL);
+	if (desc == NULL || hid_controls == NULL) {
+		printk(KERN_WARNING"%s() memory allocation failed\n",__FUNCTION__);
+		goto check_hid_input_controls_bail;
+	}
+
+	ret = usb_control_msg(ubulk->chip->dev, usb_rcvctrlpipe(ubulk->chip->dev, 0),
+						USB_REQ_GET_DESCRIPTOR, USB_DIR_IN | USB_RECIP_INTERFACE,
+						HDJ_DT_HID_REPORT << 8, interface_number, desc, desc_len,
+						USB_CTRL_GET_TIMEOUT);
+	if (ret < 0) {
+		printk(KERN_INFO"%s() failed to get the report descriptor, rc:%d\n",__FUNCTION__,ret);
+		goto check_hid_input_controls_bail;
+	}
+
+	num_controls = parse_hid_input_controls(desc, ret, ubulk->continuous_reader_packet_size,
+											hid_controls);
+	for (i = 0; i < ubulk->num_input_controls; i++) {
+		control = &ubulk->input_controls[i];
+		if (control->byte_number + control->num_bytes > ubulk->continuous_reader_packet_size) {
+			continue;
+		}
+		num_table_controls++;
+		if (!has_input_control(hid_controls, num_controls, control)) {
+			printk(KERN_WARNING"%s() product:%d control:%u of type:%u is not in the report "
+					"descriptor\n",__FUNCTION__,ubulk->chip->product_code,
+					control->control_id,control->type);
+			goto check_hid_input_controls_bail;
+		}
+	}
+	if (num_table_controls != num_controls) {
+		printk(KERN_WARNING"%s() product:%d the report descriptor has %d controls, the table "
+				"%d\n",__FUNCTION__,ubulk->chip->product_code,num_controls,num_table_controls);
+	}
+
+check_hid_input_controls_bail:
+	if (desc != NULL) {
+		kfree(desc);
+	}
+	if (hid_controls != NULL) {
+		kfree(hid_controls);
+	}
+}
+
+/* reads a control of 1 or 2 bytes, HID fields being little endian */
+static inline u32 input_control_value(const struct hdj_input_control *control, const u8 *buffer)
+{
+	if (control->num_bytes == 2) {
+		return buffer[control->byte_number] | (buffer[control->byte_number + 1] << 8);
+	}
+	return buffer[control->byte_number];
+}
+
+static inline void add_decoded_event(struct usb_hdjbulk *ubulk, int *num_events, 
+									u64 timestamp_ns, u16 control_id, u8 type, u32 value)
+{
+	struct dj_control_event *event = &ubulk->decoded_events[(*num_events)++];
+
+	event->timestamp_ns = timestamp_ns;
+	event->control_id = control_id;
+	event->type = type;
+	event->reserved = 0;
+	event->value = value;
+}
+
+/* 
+ * Decodes the controls which changed since the previous report, kept in reader_cached_buffer,
+ *  and the relative controls which moved, into decoded_events.  Returns the number of events.
+ * ALERT: read_list_lock needs to be acquired before calling 
+ */
+static int decode_input_report(struct usb_hdjbulk *ubulk, u64 timestamp_ns, 
+								u8 *buffer, unsigned long size)
+{
+	const struct hdj_input_control *control;
+	const u8 *cached = ubulk->reader_cached_buffer;
+	unsigned long byte_number, end;
+	u32 value;
+	u8 mask;
+	int i, num_events = 0;
+
+	if (size > ubulk->continuous_reader_packet_size) {
+		size = ubulk->continuous_reader_packet_size;
+	}
+
+	/* Each byte is in at most one run, and each control in the table once, so there are no 
+	 *  more events than entries in decoded_events */
+	for (i = 0; i < ubulk->num_input_controls; i++) {
+		control = &ubulk->input_controls[i];
+		if (control->report_id != 0 && (size == 0 || buffer[0] != control->report_id)) {
+			continue;
+		}
+		end = control->byte_number + control->num_bytes;
+		if (end > size) {
+			continue;
+		}
+		switch (control->type) {
+		case DJ_CONTROL_TYPE_BUTTON:
+		case DJ_CONTROL_TYPE_FLAG:
+			mask = 1 << control->bit_number;
+			if (((buffer[control->byte_number] ^ cached[control->byte_number]) & mask)!=0) {
+				add_decoded_event(ubulk, &num_events, timestamp_ns, control->control_id, 
+						control->type, (buffer[control->byte_number] & mask)!=0);
+			}
+			break;
+		case DJ_CONTROL_TYPE_ABSOLUTE:
+			value = input_control_value(control, buffer);
+			if (value != input_control_value(control, cached)) {
+				add_decoded_event(ubulk, &num_events, timestamp_ns, control->control_id, 
+						control->type, value);
+			}
+			break;
+		case DJ_CONTROL_TYPE_RELATIVE:
+			/* the field is the movement since the previous report, sign extended */
+			value = input_control_value(control, buffer);
+			if (control->num_bytes == 2) {
+				value = (u32)(s32)(s16)value;
+			} else {
+				value = (u32)(s32)(s8)value;
+			}
+			if (value != 0) {
+				add_decoded_event(ubulk, &num_events, timestamp_ns, control->control_id, 
+						control->type, value);
+			}
+			break;
+		default:
+			for (byte_number = control->byte_number; byte_number < end; byte_number++) {
+				if (buffer[byte_number]!=cached[byte_number]) {
+					add_decoded_event(ubulk, &num_events, timestamp_ns, 
+						DJ_CONTROL_ID(byte_number,0),
+						control->type, buffer[byte_number]);
+				}
+			}
+			break;
+		}
+	}
+	return num_events;
+}
+
+/* 
+ * Compares a report with the previous one, which is kept in reader_cached_buffer.  The sequence
+ *  byte of the DJ Control Steel changes with every report, so it is not compared.
+ * ALERT: read_list_lock needs to be acquired before calling 
+ */
+static int input_report_changed(struct usb_hdjbulk *ubulk, u8 *buffer, unsigned long size)
+{
+	unsigned long skip;
+
+	if (size > ubulk->continuous_reader_packet_size) {
+		size = ubulk->continuous_reader_packet_size;
+	}
+	skip = size;
+	if (ubulk->chip->product_code==DJCONTROLSTEEL_PRODUCT_CODE && 
+	    size > DJ_STEEL_EP_81_SEQ_NUM) {
+		skip = DJ_STEEL_EP_81_SEQ_NUM;
+	}
+
+	if (memcmp(buffer, ubulk->reader_cached_buffer, skip)!=0) {
+		return 1;
+	}
+	if (skip + 1 < size && 
+	    memcmp(buffer + skip + 1, ubulk->reader_cached_buffer + skip + 1, size - skip - 1)!=0) {
+		return 1;
+	}
+	return 0;
+}
+
+/* wakes up the threads which wait for data from this reader */
+static inline void wake_reader(struct hdj_read_list *read_list_item)
+{
+	/*
+	 * Orders the ring_head update of the caller against the check for waiters, which pairs
+	 *  with the barrier in wait_event's prepare_to_wait().  Every waiting thread is woken up,
+	 *  and those which find nothing left go back to sleep.
+	 */
+	smp_mb();
+	if (waitqueue_active(&read_list_item->read_wait)) {
+		wake_up_interruptible(&read_list_item->read_wait);
+	}
+}
+
+/* 
+ * Queues a report for every reader, except for change-only readers if it is unchanged and no
+ *  keyframe is due, and the decoded events for event readers.  The file which has mapped the
+ *  shared ring, if any, is skipped.  Returns the number of readers for which something was 
+ *  queued.
+ * ALERT: read_list_lock needs to be acquired before calling 
+ */
+static int fill_queued_buffers(struct list_head *open_list, const struct file *ring_file,
+								const struct dj_read_timestamp_header *stamp,
+								int changed, void * buffer, unsigned long size,
+								const struct dj_control_event *events, int num_events)
 {
 	struct list_head *p_read_item;
 	struct list_head *next_read_item;
@@ -2181,11 +3424,10 @@ static void fill_queued_buffers(struct list_head *open_list, void * buffer, unsi
 	struct list_head *next_open_item;
 	struct hdj_open_list * open_list_item;
 
-	struct list_head *p_buffer_item;
-	struct list_head *next_buffer_item;
-	struct hdj_read_buffers* read_buffer_item = NULL;
-	int buffer_depth=0;
+	unsigned long buffer_depth;
 	int size_to_copy;
+	int skip_unchanged, latest_only, events_only;
+	int queued = 0;
 
 	if (size > HDJ_POLL_INPUT_BUFFER_SIZE) {
 		printk(KERN_DEBUG"%s buffer too large (%lu), max:%lu, will truncate\n",
@@ -2195,86 +3437,131 @@ static void fill_queued_buffers(struct list_head *open_list, void * buffer, unsi
 		size_to_copy = size;	
 	}
 
-	/* copy data to first available buffer, or if none are free, reuse the oldest one */
+	/* queue the data in every reader's ring, discarding the oldest report if it is full */
 	if (!list_empty(open_list)) {
 		list_for_each_safe(p_open_item,next_open_item,open_list) {
 			open_list_item = list_entry(p_open_item, struct hdj_open_list, list);
+			if (open_list_item->file==ring_file) {
+				continue;
+			}
+			skip_unchanged = changed==0 && 
+				(open_list_item->read_flags & DJ_READ_FLAG_CHANGES_ONLY)!=0;
+			latest_only = (open_list_item->read_flags & DJ_READ_FLAG_LATEST)!=0;
+			events_only = (open_list_item->read_flags & DJ_READ_FLAG_EVENTS)!=0;
 
 			if (!list_empty(&open_list_item->read_list)) {
 				list_for_each_safe(p_read_item, next_read_item, &open_list_item->read_list) {
 					read_list_item = list_entry(p_read_item, struct hdj_read_list, list);
-					
-					if (!list_empty(&read_list_item->list_buffers)) {
-						buffer_depth=0;
-						list_for_each_safe(p_buffer_item, next_buffer_item, 
-											&read_list_item->list_buffers) {
-							read_buffer_item = list_entry(p_buffer_item, 
-													struct hdj_read_buffers, list);
-							if (read_buffer_item->is_ready == 0) {
-								break;
-							} else {
-								buffer_depth++;
-								read_buffer_item = NULL;
-							}
+
+					if (events_only) {
+						/* cursors added while events were off have no ring yet */
+						if (num_events==0 || read_list_item->events==NULL) {
+							continue;
 						}
+						buffer_depth = event_ring_produce(read_list_item, events, num_events);
+						if (buffer_depth>read_list_item->max_depth) {
+							read_list_item->max_depth = buffer_depth;
+						}
+						read_list_item->queued += num_events;
+						queued++;
+						wake_reader(read_list_item);
+						continue;
+					}
+
+					/* a reader which never received a report gets the current state */
+					if (skip_unchanged && read_list_item->ring_head!=0 &&
+					    (open_list_item->keyframe_interval==0 ||
+					     time_before(jiffies, read_list_item->last_queued_jiffies + 
+										open_list_item->keyframe_interval))) {
+						continue;
+					}
 
-						if (buffer_depth>buffer_queue_depth) {
-							buffer_queue_depth = buffer_depth;
+					/* readers in latest mode read the report which the caller stored */
+					if (!latest_only) {
+						buffer_depth = reader_ring_produce(read_list_item, stamp, 
+															buffer, size_to_copy);
+						if (buffer_depth>(unsigned long)buffer_queue_depth) {
+							buffer_queue_depth = (int)buffer_depth;
 							/*printk(KERN_INFO"%s() new max depth:%d\n",
 								__FUNCTION__,buffer_queue_depth);*/
 						}
-
-						/* if no elements are free, reuse the oldest one and move it to the end of the list*/
-						if (read_buffer_item == NULL) {
-							/*printk(KERN_DEBUG"%s(), reusing element\n",__FUNCTION__);*/
-							read_buffer_item = list_entry(read_list_item->list_buffers.next, struct hdj_read_buffers, list);
-							list_del(&read_buffer_item->list);
-							list_add_tail(&read_buffer_item->list,&read_list_item->list_buffers);
-						}
-						
-						/* copy the buffer and pad the rest with zeros */
-						memcpy(read_buffer_item->buffer, buffer, size_to_copy);
-						memset(&read_buffer_item->buffer[size_to_copy], 0, 
-								sizeof(read_buffer_item->buffer) - size_to_copy);
-						read_buffer_item->is_ready = 1;
-
-						/*
-						 * We are under lock, so we don't worry about barriers 
-						 *  Check if someone is waiting for this data, and if so,
-						 *   wake them up.  
-						 */
-						if (atomic_cmpxchg(&read_list_item->num_pending_waits,
-											1,0)==1) {
-							/* We copied the data, wake up the client- if multiple clients
-							 *  are waiting only one of them will be woken up */
-							complete(&read_list_item->read_completion);
+						if (buffer_depth>read_list_item->max_depth) {
+							read_list_item->max_depth = buffer_depth;
 						}
 					}
+					read_list_item->queued++;
+					read_list_item->last_queued_jiffies = jiffies;
+					queued++;
+					wake_reader(read_list_item);
 				}
 			}
 		}
 	}
+	return queued;
 }
 
 
-ssize_t hdjbulk_read(struct file * file, char __user *buf, size_t len, loff_t *ppos)
+/* 
+ * Copies the data into the shared input ring, if a client has mapped it.  Only constants and
+ *  our own copy of the head are trusted, as the mapping is writable by usermode.
+ * ALERT: read_list_lock needs to be acquired before calling 
+ */
+static void fill_input_ring(struct usb_hdjbulk *ubulk, void * buffer, unsigned long size)
+{
+	struct dj_input_ring_header *ring = ubulk->input_ring;
+	u32 head = ubulk->input_ring_head;
+	u8 *slot;
+
+	if (ring==NULL) {
+		return;
+	}
+
+	if (size > DJ_INPUT_RING_REPORT_SIZE) {
+		size = DJ_INPUT_RING_REPORT_SIZE;
+	}
+
+	/* count overruns for a client which keeps its position in tail */
+	if (head - hdj_read_once(ring->tail) >= DJ_INPUT_RING_NUM_REPORTS) {
+		ring->overruns++;
+	}
+
+	/* copy the buffer and pad the rest with zeros */
+	slot = (u8*)ring + sizeof(struct dj_input_ring_header) + 
+		(head & (DJ_INPUT_RING_NUM_REPORTS-1))*DJ_INPUT_RING_REPORT_SIZE;
+	memcpy(slot, buffer, size);
+	memset(slot + size, 0, DJ_INPUT_RING_REPORT_SIZE - size);
+
+	/* publish the report only once its contents are visible */
+	smp_wmb();
+	ubulk->input_ring_head = head + 1;
+	ring->head = head + 1;
+}
+
+/* 
+ * Common to read and read_iter.  The data is copied to buf, or to the iterator if one is 
+ *  passed.  If nonblock is set, returns -EAGAIN rather than waiting for data.
+ */
+static ssize_t hdjbulk_do_read(struct file * file, char __user *buf, struct iov_iter *to, 
+								size_t len, int nonblock)
 {
 	int ret = -EINVAL;
 	int chip_index;
 	struct usb_hdjbulk *ubulk=NULL;
 	struct snd_hdj_chip* chip=NULL;
-	struct list_head *p_buffer_item;
-	struct list_head *next_buffer_item;
 	struct hdj_open_list* open_list_item = NULL;
 	struct hdj_read_list* read_list_item = NULL;
-	struct hdj_read_buffers* read_buffer_item = NULL;
 	unsigned long flags;
-	long is_empty = 1;
-	long current_thread_id = 0;
-	struct completion *read_completion = NULL;
-	unsigned long ctouser = 0;
-
-	chip_index = (int)(unsigned long)file->private_data;
+	u32 read_flags = 0;
+	size_t header_size = 0;
+	size_t report_size;
+	unsigned long max_count = 1;
+	unsigned long ring_size;
+	struct dj_read_batch_header batch_header;
+	/* a read is gathered here and copied to usermode at once, single reports stay on the stack */
+	u8 stage_report[sizeof(struct dj_read_batch_header) + HDJ_READ_RING_SLOT_SIZE];
+	u8 *stage = stage_report;
+
+	chip_index = open_list_from_file(file)->chip_index;
 
 	chip = inc_chip_ref_count(chip_index);
 	if (!chip) {
@@ -2302,27 +3589,10 @@ ssize_t hdjbulk_read(struct file * file, char __user *buf, size_t len, loff_t *p
 	 *  data is available, the caller will be blocked.  However, in the event of USB disconnect, 
 	 *  the caller is unblocked */
 	if (is_continuous_reader_supported(ubulk->chip)==1) {
-		/* check if the size is valid */
-		if (len < ubulk->continuous_reader_packet_size) {
-			ret = -EINVAL;
-			printk(KERN_WARNING"%s() Invalid Parameters: len: %zd is smaller then \
-					ubulk->continuous_reader_packet_size: %d\n",
-					__FUNCTION__,len, ubulk->continuous_reader_packet_size);
-			goto hdjbulk_read_bail;
-		}
+		open_list_item = open_list_from_file(file);
 
 		spin_lock_irqsave(&ubulk->read_list_lock, flags);
 
-		/* get the open queue list item matching the file */
-		open_list_item = get_open_list_element(&ubulk->open_list, file);
-		if (open_list_item == NULL) {
-			ret = -EINVAL;
-			printk(KERN_WARNING"%s() no elements matching file:%p are found.\n",__FUNCTION__,file);
-			spin_unlock_irqrestore(&ubulk->read_list_lock, 
-						flags);
-			goto hdjbulk_read_bail;
-		}
-
 		/* increment the count */
 		++open_list_item->access_count;
 
@@ -2333,136 +3603,175 @@ ssize_t hdjbulk_read(struct file * file, char __user *buf, size_t len, loff_t *p
 			goto hdjbulk_read_in_progress_bail;
 		}
 
-		/* get the thread id */
-		current_thread_id = current->pid;
+		/* nothing is queued for the file which reads the shared ring */
+		if (ubulk->input_ring_file==file) {
+			ret = -EBUSY;
+			printk(KERN_WARNING"%s() the file has mapped the input ring\n",__FUNCTION__);
+			goto hdjbulk_read_in_progress_bail;
+		}
 
-		/* get the read queue list element for this thread */
-		read_list_item = get_read_list_element(&open_list_item->read_list, current_thread_id);
-		if (read_list_item == NULL) {
-			/* create a new element for this thread */
-			ret = alloc_and_init_read_list_item(&read_list_item, current_thread_id);
-			if (ret != 0) {
-				printk(KERN_WARNING"%s() alloc_and_init_read_list_item failed.\n",__FUNCTION__);
-				goto hdjbulk_read_in_progress_bail;
+		/* in batch mode, return as many reports as fit, after the optional header */
+		read_flags = open_list_item->read_flags;
+		report_size = ubulk->continuous_reader_packet_size;
+		if (read_flags & DJ_READ_FLAG_EVENTS) {
+			/* events are always read in batches, and carry their own timestamp */
+			report_size = sizeof(struct dj_control_event);
+		} else {
+			if (read_flags & DJ_READ_FLAG_TIMESTAMP) {
+				report_size += sizeof(struct dj_read_timestamp_header);
+			}
+			if (read_flags & DJ_READ_FLAG_BATCH) {
+				if (read_flags & DJ_READ_FLAG_BATCH_HEADER) {
+					header_size = sizeof(batch_header);
+				}
 			}
+		}
+		if (len < header_size + report_size) {
+			ret = -EINVAL;
+			printk(KERN_WARNING"%s() Invalid Parameters: len: %zd is too small for read flags:0x%x\n",
+					__FUNCTION__,len,read_flags);
+			goto hdjbulk_read_in_progress_bail;
+		}
+		if (read_flags & DJ_READ_FLAG_EVENTS) {
+			max_count = len / report_size;
+		} else if (read_flags & DJ_READ_FLAG_BATCH) {
+			max_count = (len - header_size) / report_size;
+		}
 
-			/* we will have to wait for data to arrive, reference the completion */
-			read_completion = &read_list_item->read_completion;
+		read_list_item = get_reader(open_list_item);
+		if ((read_flags & DJ_READ_FLAG_EVENTS) && read_list_item->events == NULL) {
+			/* adding this thread's cursor failed to allocate its event ring */
+			ret = -ENOMEM;
+			goto hdjbulk_read_in_progress_bail;
+		}
+		spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
 
-			list_add_tail(&read_list_item->list,&open_list_item->read_list);
+		/* a read returns no more than a full ring */
+		if (read_flags & DJ_READ_FLAG_EVENTS) {
+			ring_size = read_list_item->event_mask + 1;
 		} else {
-			/* verify if a buffer is ready */
-			if (list_empty(&read_list_item->list_buffers)) {
+			ring_size = read_list_item->ring_mask + 1;
+		}
+		if (max_count > ring_size) {
+			max_count = ring_size;
+		}
+		if (header_size + max_count*report_size > sizeof(stage_report)) {
+			stage = kmalloc(header_size + max_count*report_size, GFP_KERNEL);
+			if (stage == NULL) {
+				printk(KERN_WARNING"%s() failed to allocate staging buffer\n",__FUNCTION__);
 				ret = -ENOMEM;
-				printk(KERN_WARNING"%s() buffer list is empty.\n",__FUNCTION__);
+				stage = stage_report;
+				spin_lock_irqsave(&ubulk->read_list_lock, flags);
 				goto hdjbulk_read_in_progress_bail;
 			}
-			is_empty = 1;
-			list_for_each_safe(p_buffer_item, next_buffer_item, &read_list_item->list_buffers) {
-				read_buffer_item = list_entry(p_buffer_item, struct hdj_read_buffers, list);
-				if (read_buffer_item->is_ready == 1) {
-					is_empty = 0;
+		}
+
+		/* Our access count keeps the reader alive, so the ring is consumed without the lock. */
+		for (;;) {
+			/* if release was called, bail */
+			if (hdj_read_once(open_list_item->is_releasing)) {
+				ret = -ENODEV;
+				printk(KERN_WARNING"%s() error, release was called.\n",__FUNCTION__);
+				break;
+			}
+
+			if (read_flags & DJ_READ_FLAG_EVENTS) {
+				ret = event_ring_consume(read_list_item, stage, max_count);
+			} else if (read_flags & DJ_READ_FLAG_LATEST) {
+				ret = read_latest_report(ubulk, read_list_item, stage + header_size,
+									ubulk->continuous_reader_packet_size,
+									(read_flags & DJ_READ_FLAG_TIMESTAMP)!=0);
+			} else {
+				ret = reader_ring_consume(read_list_item, stage + header_size, 
+									ubulk->continuous_reader_packet_size,
+									max_count,
+									(read_flags & DJ_READ_FLAG_TIMESTAMP)!=0);
+			}
+			if (ret > 0) {
+				if (header_size!=0) {
+					batch_header.count = ret;
+					batch_header.packet_size = ubulk->continuous_reader_packet_size;
+					memcpy(stage, &batch_header, header_size);
+				}
+				/* set the return value to the amount of bytes read */
+				ret = header_size + ret*report_size;
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0) )
+				if (to != NULL) {
+					if (copy_to_iter(stage, ret, to) != ret) {
+						printk(KERN_WARNING"%s() copy_to_iter failed\n",__FUNCTION__);
+						ret = -EFAULT;
+					}
 					break;
 				}
+#endif
+				if (copy_to_user(buf, stage, ret) != 0) {
+					printk(KERN_WARNING"%s() copy_to_user failed\n",__FUNCTION__);
+					ret = -EFAULT;
+				}
+				break;
 			}
-			if (is_empty == 1) {
-				/* we will have to wait for data to arrive, reference the completion */
-				read_completion = &read_list_item->read_completion;
-			}
-		}
-		spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
 
-		if (read_completion != NULL) {
-			/* there is no data presently, so we'll have to wait for some */
-			
-			/* but don't wait if the O_NON_BLOCK flag is set */
-			if (file->f_flags & O_NONBLOCK) {
+			/* there is no data presently, but don't wait if the O_NON_BLOCK flag is set */
+			if (nonblock) {
 				ret = -EAGAIN;
 				/*printk(KERN_INFO"%s() the data isn't ready, but the O_NONBLOCK flag is set, so bail\n",
 						__FUNCTION__);*/
-				spin_lock_irqsave(&ubulk->read_list_lock, flags);
-				goto hdjbulk_read_in_progress_bail;
+				break;
 			}
 
-			/* Signal that we are about to wait- use the lock instead of barriers, as 
-			 *  the completion routine will use this lock */
-			spin_lock_irqsave(&ubulk->read_list_lock, flags);
-			atomic_set(&read_list_item->num_pending_waits,1);
-			spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
-
-			/* wait for the buffer */
-			wait_for_completion_interruptible(read_completion);
-			if (signal_pending(current)) {
+			/* Wait for data.  Threads which share the cursor are all woken up, so one which 
+			 *  loses the race for the data just waits again. */
+			if (wait_event_interruptible(read_list_item->read_wait,
+					reader_has_data(ubulk, read_list_item, read_flags) ||
+					hdj_read_once(open_list_item->is_releasing)) != 0) {
 				printk(KERN_INFO"%s() signal pending, will break\n",__FUNCTION__);
 				/* we have been woken up by a signal- reflect this in the return code */
 				ret = -ERESTARTSYS;
-				spin_lock_irqsave(&ubulk->read_list_lock, flags);
-				goto hdjbulk_read_in_progress_bail;
+				break;
 			}
-		} else {
-			/*printk(KERN_INFO"%s() NOT waiting for the notification\n",__FUNCTION__);*/
-		}
-
-		spin_lock_irqsave(&ubulk->read_list_lock, flags);
-
-		/* if release was called, bail */
-		if (open_list_item->is_releasing) {
-			ret = -ENODEV;
-			printk(KERN_WARNING"%s() error, release was called.\n",__FUNCTION__);
-			goto hdjbulk_read_in_progress_bail;
-		}
-		
-		if (list_empty(&read_list_item->list_buffers)) {
-			ret = -ENOMEM;
-			printk(KERN_WARNING"%s() buffer list is empty.\n",__FUNCTION__);
-			goto hdjbulk_read_in_progress_bail;
-		}
-		/* get the buffer */
-		read_buffer_item = list_entry(read_list_item->list_buffers.next, struct hdj_read_buffers, list);
-		if (read_buffer_item->is_ready == 0) {
-			ret = -EINVAL;
-			printk(KERN_WARNING"%s() signal received, but the list is empty.\n",__FUNCTION__);
-			goto hdjbulk_read_in_progress_bail;
-		}
-
-		/* remove the buffer from the list while it is in use */
-		list_del(&read_buffer_item->list);
-		spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
-
-		/* copy the buffer to usermode */
-		ctouser = copy_to_user((void*)buf,read_buffer_item->buffer,ubulk->continuous_reader_packet_size);
-		if (ctouser != 0) {
-			printk(KERN_WARNING"%s() copy_to_user failed, ctouser:%lu\n",
-				__FUNCTION__,
-				ctouser);
 		}
 
-		/* set the return value to the amount of bytes read */
-		ret = ubulk->continuous_reader_packet_size;
-
-		/* mark the buffer as not ready, so that it can be reused */
-		read_buffer_item->is_ready = 0;
-
 		spin_lock_irqsave(&ubulk->read_list_lock, flags);
-		/* place the buffer at the end of the list to be reused */
-		list_add_tail(&read_buffer_item->list,&read_list_item->list_buffers);
 
 hdjbulk_read_in_progress_bail:
 		/* decrement the usage count and free the memory if it reaches 0 */
 		--open_list_item->access_count;
 		if (open_list_item->access_count == 0) {
-			free_open_list(&ubulk->open_list, file);
+			free_open_list_item(open_list_item);
 		}
 		spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
+		if (stage != stage_report) {
+			kfree(stage);
+		}
 	} else {
 		/* This product has no continuous reader */
 		ret = -ENXIO;
 	}
 
-hdjbulk_read_bail:
-	dec_chip_ref_count(chip_index);
-	return ret;
+hdjbulk_read_bail:
+	dec_chip_ref_count(chip_index);
+	return ret;
+}
+
+ssize_t hdjbulk_read(struct file * file, char __user *buf, size_t len, loff_t *ppos)
+{
+	return hdjbulk_do_read(file, buf, NULL, len, (file->f_flags & O_NONBLOCK)!=0);
+}
+
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0) )
+/* 
+ * For io_uring and AIO.  IOCB_NOWAIT is treated as O_NONBLOCK, so that io_uring can try the 
+ *  read inline and fall back on poll.  The reports are staged in a kernel buffer, so any kind 
+ *  of iterator can be filled, across as many segments as it has.
+ */
+ssize_t hdjbulk_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	int nonblock;
+
+	nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK)!=0 || (iocb->ki_flags & IOCB_NOWAIT)!=0;
+	return hdjbulk_do_read(iocb->ki_filp, NULL, to, iov_iter_count(to), nonblock);
 }
+#endif
 
 unsigned int hdjbulk_poll(struct file * file, struct poll_table_struct * wait)
 {
@@ -2470,109 +3779,78 @@ unsigned int hdjbulk_poll(struct file * file, struct poll_table_struct * wait)
 	int chip_index;
 	struct usb_hdjbulk *ubulk=NULL;
 	struct snd_hdj_chip* chip=NULL;
-	struct list_head *p_buffer_item;
-	struct list_head *next_buffer_item;
 	struct hdj_open_list* open_list_item = NULL;
 	struct hdj_read_list* read_list_item = NULL;
-	struct hdj_read_buffers* read_buffer_item = NULL;
 	unsigned long flags;
-	long is_empty = 1;
-	long current_thread_id = 0;
+	unsigned int mmap_mask = 0;
 
-	chip_index = (int)(unsigned long)file->private_data;
+	chip_index = open_list_from_file(file)->chip_index;
 
 	chip = inc_chip_ref_count(chip_index);
 	if (!chip) {
 		printk(KERN_WARNING"%s() no context, bailing!\n",__FUNCTION__);
-		return -ENODEV;
+		return HDJ_POLL_HANGUP_MASK;
 	}
 
 	ubulk = bulk_from_chip(chip);
 	if (ubulk==NULL) {
 		printk(KERN_WARNING"%s() bulk_from_chip returned NULL\n",__FUNCTION__);
-		ret = -ENODEV;
+		ret = HDJ_POLL_HANGUP_MASK;
 		goto hdjbulk_poll_bail;
 	}
 
+	poll_wait(file, &ubulk->read_poll_wait, wait);
+
 	if (can_send_urbs(chip)!=0) {
-		printk(KERN_INFO"%s() I/O forbidden, bailing\n",__FUNCTION__);
-		ret = -ENODEV;
+		/* while suspended there is simply nothing to read, but shutdown is a hangup */
+		if (atomic_read(&chip->shutdown)!=0) {
+			printk(KERN_INFO"%s() I/O forbidden, bailing\n",__FUNCTION__);
+			ret = HDJ_POLL_HANGUP_MASK;
+		}
 		goto hdjbulk_poll_bail;
 	}
 
-	poll_wait(file, &ubulk->read_poll_wait, wait);
-
 	/* Only supported for those products which have continuous readers */
 	if (is_continuous_reader_supported(ubulk->chip)==1) {
 		spin_lock_irqsave(&ubulk->read_list_lock, flags);
 
-		/* get the open queue list item matching the file */
-		open_list_item = get_open_list_element(&ubulk->open_list, file);
-		if (open_list_item == NULL) {
-			ret = 0;
-			printk(KERN_WARNING"%s() no elements matching file:%p are found.\n",__FUNCTION__,file);
-			spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
-			goto hdjbulk_poll_bail;
-		}
+		open_list_item = open_list_from_file(file);
 
 		/* increment the count */
 		++open_list_item->access_count;
 
 		/* if release was called, bail */
 		if (open_list_item->is_releasing) {
-			ret = -ENODEV;
+			ret = HDJ_POLL_HANGUP_MASK;
 			printk(KERN_WARNING"%s() error, release was called.\n",__FUNCTION__);
 			goto hdjbulk_poll_in_progress_bail;
 		}
 
-		/* get the thread id */
-		current_thread_id = current->pid;
-
-		/* get the read queue list element for this thread */
-		read_list_item = get_read_list_element(&open_list_item->read_list, current_thread_id);
-		if (read_list_item == NULL) {
-			/* create a new element for this thread */
-			ret = alloc_and_init_read_list_item(&read_list_item, current_thread_id);
-			if (ret != 0) {
-				printk(KERN_WARNING"%s() alloc_and_init_read_list_item failed.\n",__FUNCTION__);
-				goto hdjbulk_poll_in_progress_bail;
+		read_list_item = get_reader(open_list_item);
+		if (ubulk->input_ring_file==file) {
+			/* the client of the shared ring keeps its position in the ring's tail, and 
+			 *  nothing is queued for its read */
+			if (hdj_read_once(ubulk->input_ring->tail)!=ubulk->input_ring_head) {
+				mmap_mask = POLLIN | POLLRDNORM;
 			}
-
-			list_add_tail(&read_list_item->list,&open_list_item->read_list);
-
-			/* a structure was allocated, but it isn't filled yet */
 			ret = 0;
+		} else if (reader_has_data(ubulk, read_list_item, open_list_item->read_flags)) {
+			/* the ring contains elements for read */
+			ret = POLLIN | POLLRDNORM;
 		} else {
-			/* verify if a buffer is ready */
-			if (list_empty(&read_list_item->list_buffers)) {
-				/* no data available */
-				ret = 0;
-				goto hdjbulk_poll_in_progress_bail;
-			}
-			is_empty = 1;
-			list_for_each_safe(p_buffer_item, next_buffer_item, &read_list_item->list_buffers) {
-				read_buffer_item = list_entry(p_buffer_item, struct hdj_read_buffers, list);
-				if (read_buffer_item->is_ready == 1) {
-					is_empty = 0;
-					break;
-				}
-			}
-			if (is_empty == 1) {
-				/* the structure is empty */
-				ret = 0;	
-			} else {
-				/* the structure contains elements for read */
-				ret = POLLIN | POLLRDNORM;
-			}
+			/* the ring is empty */
+			ret = 0;
 		}
 hdjbulk_poll_in_progress_bail:
 		/* decrement the usage count and free the memory if it reaches 0 */
 		--open_list_item->access_count;
 		if (open_list_item->access_count == 0) {
-			free_open_list(&ubulk->open_list, file);
+			free_open_list_item(open_list_item);
 
 			/* since the object was freed, read is no longer available */
 			ret = 0;
+		} else {
+			ret |= mmap_mask;
 		}
 		spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
 	}
@@ -2582,6 +3860,134 @@ hdjbulk_poll_bail:
 	return ret;
 }
 
+/* Each mapping of the input ring holds a chip reference, so that ubulk outlives it. */
+static void input_ring_vm_open(struct vm_area_struct *vma)
+{
+	struct usb_hdjbulk *ubulk = vma->vm_private_data;
+
+	/* the mapping which is being copied holds a reference */
+	hold_chip_ref_count(ubulk->chip);
+	down(&ubulk->input_ring_mutex);
+	ubulk->input_ring_map_count++;
+	up(&ubulk->input_ring_mutex);
+}
+
+static void input_ring_vm_close(struct vm_area_struct *vma)
+{
+	struct usb_hdjbulk *ubulk = vma->vm_private_data;
+	struct snd_hdj_chip* chip = ubulk->chip;
+	unsigned long flags;
+
+	down(&ubulk->input_ring_mutex);
+	if (--ubulk->input_ring_map_count == 0) {
+		/* the file's reads are queued again, and another file may map the ring */
+		spin_lock_irqsave(&ubulk->read_list_lock, flags);
+		ubulk->input_ring_file = NULL;
+		spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
+	}
+	up(&ubulk->input_ring_mutex);
+	/* may tear the chip down, and free ubulk with it */
+	dec_chip_ref_count(chip->index);
+}
+
+static const struct vm_operations_struct input_ring_vm_ops = {
+	.open =		input_ring_vm_open,
+	.close =	input_ring_vm_close,
+};
+
+/* ALERT: input_ring_mutex needs to be acquired before calling */
+static int map_input_ring(struct usb_hdjbulk *ubulk, struct file *file, 
+							struct vm_area_struct *vma)
+{
+	unsigned long flags;
+	int ret;
+
+	/* the ring has a single tail, which two clients would overwrite */
+	if (ubulk->input_ring_map_count!=0 && ubulk->input_ring_file!=file) {
+		printk(KERN_WARNING"%s() the ring is mapped by another file\n",__FUNCTION__);
+		return -EBUSY;
+	}
+
+	ret = remap_vmalloc_range(vma, ubulk->input_ring, 0);
+	if (ret!=0) {
+		printk(KERN_WARNING"%s() remap_vmalloc_range failed, ret:%d\n",__FUNCTION__,ret);
+		return ret;
+	}
+	vma->vm_ops = &input_ring_vm_ops;
+	vma->vm_private_data = ubulk;
+	/* the mapping's reference, the caller holds its own */
+	hold_chip_ref_count(ubulk->chip);
+	if (ubulk->input_ring_map_count++ == 0) {
+		spin_lock_irqsave(&ubulk->read_list_lock, flags);
+		ubulk->input_ring_file = file;
+		ubulk->input_ring->tail = ubulk->input_ring_head;
+		spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
+	}
+	return 0;
+}
+
+int hdjbulk_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int ret = 0;
+	int chip_index;
+	struct usb_hdjbulk *ubulk=NULL;
+	struct snd_hdj_chip* chip=NULL;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	chip_index = open_list_from_file(file)->chip_index;
+
+	chip = inc_chip_ref_count(chip_index);
+	if (!chip) {
+		printk(KERN_WARNING"%s() no context, bailing!\n",__FUNCTION__);
+		return -ENODEV;
+	}
+
+	ubulk = bulk_from_chip(chip);
+	if (ubulk==NULL) {
+		printk(KERN_WARNING"%s() bulk_from_chip returned NULL\n",__FUNCTION__);
+		ret = -ENODEV;
+		goto hdjbulk_mmap_bail;
+	}
+
+	if (can_send_urbs(chip)!=0) {
+		printk(KERN_INFO"%s() I/O forbidden, bailing\n",__FUNCTION__);
+		ret = -ENODEV;
+		goto hdjbulk_mmap_bail;
+	}
+
+	/* the shared output control page has its own offset */
+	if (vma->vm_pgoff==(DJ_OUTPUT_SHADOW_MMAP_OFFSET>>PAGE_SHIFT)) {
+		ret = map_output_shadow(chip, vma);
+		goto hdjbulk_mmap_bail;
+	}
+
+	/* Only the input ring of products which have continuous readers can be mapped */
+	if (is_continuous_reader_supported(ubulk->chip)==0) {
+		ret = -ENXIO;
+		goto hdjbulk_mmap_bail;
+	}
+
+	if (vma->vm_pgoff!=0 || size > get_input_ring_map_size()) {
+		printk(KERN_WARNING"%s() invalid mapping, offset:%lu size:%lu\n",
+			__FUNCTION__,vma->vm_pgoff,size);
+		ret = -EINVAL;
+		goto hdjbulk_mmap_bail;
+	}
+
+	ret = alloc_input_ring(ubulk);
+	if (ret!=0) {
+		goto hdjbulk_mmap_bail;
+	}
+
+	down(&ubulk->input_ring_mutex);
+	ret = map_input_ring(ubulk, file, vma);
+	up(&ubulk->input_ring_mutex);
+
+hdjbulk_mmap_bail:
+	dec_chip_ref_count(chip_index);
+	return ret;
+}
+
 int hdjbulk_release(struct inode *inode, struct file *file)
 {
 	int ret = 0;
@@ -2593,7 +3999,8 @@ int hdjbulk_release(struct inode *inode, struct file *file)
 
 	/*printk(KERN_INFO"%s(): tgid: %d pid: %d\n", __FUNCTION__, current->tgid, current->pid);*/
 
-	chip_index = (int)(unsigned long)file->private_data;
+	open_list_item = open_list_from_file(file);
+	chip_index = open_list_item->chip_index;
 	
 	chip = inc_chip_ref_count(chip_index);
 	if (!chip) {
@@ -2623,25 +4030,19 @@ int hdjbulk_release(struct inode *inode, struct file *file)
 	if (is_continuous_reader_supported(ubulk->chip)==1) {
 		spin_lock_irqsave(&ubulk->read_list_lock, flags);
 
-		/* get the open queue list item matching the file */
-		open_list_item = get_open_list_element(&ubulk->open_list, file);
-		if (open_list_item == NULL) {
-			ret = -EINVAL;
-			printk(KERN_WARNING"%s() no elements matching file:%p are found.\n",__FUNCTION__,file);
-			spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
-			goto hdjbulk_release_bail;
-		}
-
 		/* mark this item as having release being called on it */
 		open_list_item->is_releasing = 1;
 
 		/* decrement the usage count and free the memory if it reaches 0 */
 		--open_list_item->access_count;
 		if (open_list_item->access_count == 0) {
-			free_open_list(&ubulk->open_list, file);
+			free_open_list_item(open_list_item);
 		}	
 
 		spin_unlock_irqrestore(&ubulk->read_list_lock,flags);
+	} else {
+		/* the item was never added to open_list */
+		free_open_list_item(open_list_item);
 	}
 
 hdjbulk_release_bail:
@@ -2664,7 +4065,7 @@ static void kill_continuous_reader_urbs(struct usb_hdjbulk *ubulk, u8 free_urbs)
 			ubulk->reader_cached_buffer = NULL;	
 		}
 	}
-	for (i = 0; i < DJ_POLL_INPUT_URB_COUNT; i++) {
+	for (i = 0; i < DJ_POLL_INPUT_URB_COUNT_MAX; i++) {
 		if (ubulk->bulk_in_endpoint[i] != NULL) {
 			hdjbulk_input_kill_urbs(ubulk->bulk_in_endpoint[i]);
 			if (free_urbs!=0) {
@@ -2686,24 +4087,28 @@ static void uninit_output_control_state(struct usb_hdjbulk *ubulk)
 			ubulk->output_control_ctl_req = NULL;
 		}
 
-		if (ubulk->output_control_buffer!=NULL && ubulk->control_interface!=NULL &&
+		if (ubulk->output_report_buffer!=NULL && ubulk->control_interface!=NULL &&
 		    ubulk->output_control_urb!=NULL) {
 			usb_free_coherent(interface_to_usbdev(ubulk->control_interface),
-					ubulk->output_control_urb->transfer_buffer_length,
-					ubulk->output_control_buffer,
+					ubulk->output_control_buffer_size,
+					ubulk->output_report_buffer,
 					ubulk->output_control_urb->transfer_dma);
-			ubulk->output_control_buffer = NULL;
+			ubulk->output_report_buffer = NULL;
 		}
 		if (ubulk->output_control_urb!=NULL) {
 			usb_free_urb(ubulk->output_control_urb);
 			ubulk->output_control_urb = NULL;
 		}
 	} else {
-		if (ubulk->output_control_buffer!=NULL) {
-			kfree(ubulk->output_control_buffer);
-			ubulk->output_control_buffer = NULL;
+		if (ubulk->output_report_buffer!=NULL) {
+			kfree(ubulk->output_report_buffer);
+			ubulk->output_report_buffer = NULL;
 		}
 	}
+	if (ubulk->output_control_buffer!=NULL) {
+		kfree(ubulk->output_control_buffer);
+		ubulk->output_control_buffer = NULL;
+	}
 	if (ubulk->control_interface!=NULL) {
 		usb_put_intf(ubulk->control_interface);
 		ubulk->control_interface = NULL;
@@ -2726,6 +4131,21 @@ void kill_bulk_urbs(struct usb_hdjbulk *ubulk, u8 free_urbs)
 		}
 	}
 	kill_continuous_reader_urbs(ubulk,free_urbs);
+
+	/* A pending output report stays dirty, and is sent on resume.  A failing worker may 
+	 *  have armed the timer for a retry, so the timer is cancelled again once it is done. */
+	hrtimer_cancel(&ubulk->output_report_timer);
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22) )
+	cancel_work_sync(&ubulk->output_report_work);
+#else
+	flush_scheduled_work();
+#endif
+	hrtimer_cancel(&ubulk->output_report_timer);
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22) )
+	cancel_work_sync(&ubulk->output_report_work);
+#else
+	flush_scheduled_work();
+#endif
 	if (ubulk->output_control_urb!=NULL) {
 		usb_kill_urb(ubulk->output_control_urb);
 		if(free_urbs!=0) {
@@ -2748,7 +4168,7 @@ static int uninit_continuous_reader(struct usb_hdjbulk *ubulk)
 		printk(KERN_INFO"%s() operation already in progress, or bad state\n",__FUNCTION__);
 		return -EINVAL;
 	}
-	for (i = 0; i < DJ_POLL_INPUT_URB_COUNT; i++) {
+	for (i = 0; i < DJ_POLL_INPUT_URB_COUNT_MAX; i++) {
 		if (ubulk->bulk_in_endpoint[i] != NULL) {
 			if (ubulk->bulk_in_endpoint[i]->iface!=NULL) {
 				usb_put_intf(ubulk->bulk_in_endpoint[i]->iface);
@@ -2781,6 +4201,12 @@ void hdj_delete(struct kref *kref)
 		kfree(ubulk->device_context);
 		ubulk->device_context = NULL;
 	}
+
+	/* existing mappings hold their own references to the pages */
+	if (ubulk->input_ring!=NULL) {
+		vfree(ubulk->input_ring);
+		ubulk->input_ring = NULL;
+	}
 	kfree(ubulk);
 }
 
@@ -2820,10 +4246,21 @@ void hdjbulk_resume(struct list_head* p)
 		return;
 	}
 
+	down(&ubulk->continuous_reader_mutex);
 	if ((rc=start_continuous_reader(ubulk))!=0) {
 		printk(KERN_WARNING"%s start_continuous_reader failed rc:%d\n",
 			__FUNCTION__,rc);
 	}
+	up(&ubulk->continuous_reader_mutex);
+
+	/* send the output update which suspend interrupted, if any */
+	if (ubulk->output_control_buffer!=NULL) {
+		down(&ubulk->output_control_mutex);
+		if (ubulk->output_report_dirty!=0) {
+			queue_output_report(ubulk);
+		}
+		up(&ubulk->output_control_mutex);
+	}
 }
 
 void snd_hdjbulk_suspend(struct list_head* p)
@@ -2834,11 +4271,13 @@ void snd_hdjbulk_suspend(struct list_head* p)
 		return;
 	}
 
+	down(&ubulk->continuous_reader_mutex);
 	kill_bulk_urbs(ubulk,0);
 	if ((rc=stop_continuous_reader(ubulk))!=0) {
 		printk(KERN_WARNING"%s stop_continuous_reader failed rc:%d\n",
 			__FUNCTION__,rc);
 	}
+	up(&ubulk->continuous_reader_mutex);
 }
 #endif
 
@@ -3010,6 +4449,21 @@ int hdj_create_bulk_interface(struct snd_hdj_chip* chip,
 	reference_usb_intf_and_devices(ubulk->iface);
 
 	init_waitqueue_head(&ubulk->read_poll_wait);
+	sema_init(&ubulk->input_ring_mutex, 1);
+	sema_init(&ubulk->continuous_reader_mutex, 1);
+	sema_init(&ubulk->output_report_mutex, 1);
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20) )
+	INIT_WORK(&ubulk->output_report_work, output_report_work);
+#else
+	INIT_WORK(&ubulk->output_report_work, output_report_work, ubulk);
+#endif
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(6,15,0) )
+	hrtimer_setup(&ubulk->output_report_timer, output_report_timer, 
+			CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&ubulk->output_report_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ubulk->output_report_timer.function = output_report_timer;
+#endif
 
 	atomic_inc(&ubulk->chip->next_bulk_device);
 
@@ -3212,48 +4666,49 @@ int hdjbulk_submit_urb(struct snd_hdj_chip* chip, struct urb* urb, int flags)
 	return err;
 }
 
-static int hdjbulk_in_urb_complete_steel(struct hdjbulk_in_endpoint *ep, struct urb* urb)
+static int hdjbulk_in_urb_complete_steel(struct hdjbulk_in_endpoint *ep, u8 *buffer, int length)
 {	
 	int index = 0;
 	struct hdj_steel_context * dc = (struct hdj_steel_context *)ep->ubulk->device_context;
 	
 	if (atomic_read(&dc->device_mode) == DJ_STEEL_IN_NORMAL_MODE) {
-		if (urb->actual_length < DJ_CONTROL_STEEL_BULK_TRANSFER_MIN_SIZE) {
-			printk(KERN_WARNING"%s() Invalid Buffer Length: %d\n", __FUNCTION__, urb->actual_length);
+		if (length < DJ_CONTROL_STEEL_BULK_TRANSFER_MIN_SIZE) {
+			printk(KERN_WARNING"%s() Invalid Buffer Length: %d\n", __FUNCTION__, length);
 			return -EINVAL;
 		}
 
 		/*check the device's sequence number*/
 		if ((atomic_inc_return(&dc->sequence_number)&0xff) != 
-				((u8*)urb->transfer_buffer)[DJ_STEEL_EP_81_SEQ_NUM]) {
+				buffer[DJ_STEEL_EP_81_SEQ_NUM]) {
 			printk(KERN_INFO"%s() Invalid sequence number: 0x%02x != 0x%02x\n", 
 				__FUNCTION__,
 				atomic_read(&dc->sequence_number), 
-				((u8*)urb->transfer_buffer)[DJ_STEEL_EP_81_SEQ_NUM]);
+				buffer[DJ_STEEL_EP_81_SEQ_NUM]);
 			atomic_set(&dc->sequence_number, 
-					(((u8*)urb->transfer_buffer)[DJ_STEEL_EP_81_SEQ_NUM]));
+					(buffer[DJ_STEEL_EP_81_SEQ_NUM]));
+			atomic_long_inc(&ep->ubulk->device_sequence_gaps);
 		}
 
 		/* Save these states */
 		/*get the fx state*/
 		atomic_set(&dc->fx_state,
-			(((u8*)urb->transfer_buffer)[DJ_STEEL_EP_81_FX_STATE_0] << 8) + 
-			(((u8*)urb->transfer_buffer)[DJ_STEEL_EP_81_FX_STATE_1] & 0xFF));
+			(buffer[DJ_STEEL_EP_81_FX_STATE_0] << 8) + 
+			(buffer[DJ_STEEL_EP_81_FX_STATE_1] & 0xFF));
 
 		/*save the setting*/
 		atomic_set(&dc->mode_shift_state,
-			((u8*)urb->transfer_buffer)[DJ_STEEL_EP_81_MODE_SHIFT_STATE]);
+			buffer[DJ_STEEL_EP_81_MODE_SHIFT_STATE]);
 
 		/*get the jog wheel parameters*/
 		atomic_set(&dc->jog_wheel_parameters,
-				(((u8*)urb->transfer_buffer)[DJ_STEEL_EP_81_JOG_WHEEL_SETTINGS_0] << 8) + 
-				(((u8*)urb->transfer_buffer)[DJ_STEEL_EP_81_JOG_WHEEL_SETTINGS_1] & 0xFF));
+				(buffer[DJ_STEEL_EP_81_JOG_WHEEL_SETTINGS_0] << 8) + 
+				(buffer[DJ_STEEL_EP_81_JOG_WHEEL_SETTINGS_1] & 0xFF));
 	} else if (atomic_read(&dc->device_mode) == DJ_STEEL_IN_BOOT_MODE) {
-		if (urb->actual_length < 2) {
-			printk(KERN_ERR"%s() Invalid Buffer Length: %d\n", __FUNCTION__,urb->actual_length);
+		if (length < 2) {
+			printk(KERN_ERR"%s() Invalid Buffer Length: %d\n", __FUNCTION__,length);
 			return -EINVAL;
 		}
-		if (((u8*)urb->transfer_buffer)[0] != ((u8*)urb->transfer_buffer)[1]) {
+		if (buffer[0] != buffer[1]) {
 			printk(KERN_ERR"%s() Invalid Buffer\n",__FUNCTION__);
 			return -EINVAL;
 		}
@@ -3265,10 +4720,10 @@ static int hdjbulk_in_urb_complete_steel(struct hdjbulk_in_endpoint *ep, struct
 
 		/* copy the buffer to the context */
 		/* IOCTLs that use this buffer are in a sequential queue, so this is safe */
-		memcpy(dc->bulk_data, urb->transfer_buffer, urb->actual_length);
+		memcpy(dc->bulk_data, buffer, length);
 
 		/*pad the rest with zeros*/
-		for(index = urb->actual_length; index < ep->max_transfer; index++) {
+		for(index = length; index < ep->max_transfer; index++) {
 			dc->bulk_data[index] = 0;
 		}
 
@@ -3318,25 +4773,63 @@ void hdjbulk_in_urb_complete(struct urb* urb, struct pt_regs *junk)
 #endif
 {
 	struct hdjbulk_in_endpoint *ep = urb->context;
+	struct dj_read_timestamp_header stamp;
+	int status = urb->status;
+	int length = 0;
+	u8 *report = NULL;
+	int changed, queued, num_events;
+
+	/* take the timestamp first, for clients which align input with their audio clock */
+	stamp.timestamp_ns = hdj_ktime_get_ns();
 	
-	if (urb->status == 0) {
+	if (status == 0) {
+		/* Copy the report out of the URB, alternating between two buffers, so that the URB can
+		 *  be resubmitted before the report is processed */
+		report = ep->report_buffer + ep->report_index*ep->max_transfer;
+		ep->report_index ^= 1;
+		length = urb->actual_length;
+		if (length > ep->max_transfer) {
+			length = ep->max_transfer;
+		}
+		memcpy(report, urb->transfer_buffer, length);
+		stamp.urb_sequence_number = atomic_read(&ep->urb_sequence_number);
+	}
+
+	/* Re-arm the URB before the fan out to the readers, so that the time during which it is off
+	 *  the bus does not depend on the number of readers.  This will not try to resubmit if we are 
+	 *  shutting down, or suspend has forbidden us to to send requests */
+	atomic_set(&ep->urb_sequence_number,
+			 (atomic_inc_return(&ep->ubulk->current_urb_sequence_number) & 0xFFFF));
+	urb->dev = ep->ubulk->chip->dev;
+	hdjbulk_submit_urb(ep->ubulk->chip, urb, GFP_ATOMIC);
+
+	if (status == 0) {
+		stamp.device_sequence_number = 0;
+		stamp.flags = 0;
+		stamp.reserved = 0;
+		if (ep->ubulk->chip->product_code==DJCONTROLSTEEL_PRODUCT_CODE &&
+		    length > DJ_STEEL_EP_81_SEQ_NUM) {
+			stamp.device_sequence_number = report[DJ_STEEL_EP_81_SEQ_NUM];
+			stamp.flags |= DJ_TIMESTAMP_HAS_DEVICE_SEQ;
+		}
 		
 		/* check the urb sequence number */
 		if (atomic_inc_return(&ep->ubulk->expected_urb_sequence_number) != 
-			atomic_read(&ep->urb_sequence_number)) {
+			stamp.urb_sequence_number) {
 			printk(KERN_INFO"%s(): len:%d sequence num: %d != %d\n",
 				__FUNCTION__,
-				urb->actual_length, atomic_read(&ep->urb_sequence_number), 
+				length, stamp.urb_sequence_number, 
 				atomic_read(&ep->ubulk->expected_urb_sequence_number) - 1);
 
 			atomic_set(&ep->ubulk->expected_urb_sequence_number,
-					atomic_read(&ep->urb_sequence_number));
+					stamp.urb_sequence_number);
+			atomic_long_inc(&ep->ubulk->urb_sequence_gaps);
 		}
 
 		/* handle steel specific processing */
 		if (ep->ubulk->chip->product_code==DJCONTROLSTEEL_PRODUCT_CODE) {
-			if (hdjbulk_in_urb_complete_steel(ep,urb)!=0) {
-				goto hdjbulk_in_urb_complete_bail;
+			if (hdjbulk_in_urb_complete_steel(ep,report,length)!=0) {
+				return;
 			}
 		}
 		
@@ -3345,30 +4838,53 @@ void hdjbulk_in_urb_complete(struct urb* urb, struct pt_regs *junk)
 	
 		/* fw fix for hm monitor */
 		if (ep->ubulk->chip->product_code==DJCONSOLE2_PRODUCT_CODE) {
-			hdjmk2_hm_fwfix(ep->ubulk,urb->transfer_buffer);	
-			memcpy(ep->ubulk->reader_cached_buffer,
-				urb->transfer_buffer,
-				urb->actual_length);
+			hdjmk2_hm_fwfix(ep->ubulk,report);	
+		}
+
+		/* remember this report, for the hm fix and for change-only readers, once decoded */
+		changed = input_report_changed(ep->ubulk, report, length);
+		num_events = 0;
+		if (changed || ep->ubulk->has_relative_controls) {
+			num_events = decode_input_report(ep->ubulk, stamp.timestamp_ns,
+								report, length);
+			/* an identical report with events has relative controls which moved, such as 
+			 *  a jog wheel turning at a constant speed- change-only readers need it too */
+			if (num_events!=0) {
+				changed = 1;
+			}
 		}
+		memcpy(ep->ubulk->reader_cached_buffer, report, length);
 
-		/* fill the queued elements- this services read */
-		fill_queued_buffers(&ep->ubulk->open_list, 
-					urb->transfer_buffer, urb->actual_length);
+		/* the newest report for latest mode, then the queued elements- this services read */
+		store_latest_report(ep->ubulk, &stamp, report, length);
+		queued = fill_queued_buffers(&ep->ubulk->open_list, ep->ubulk->input_ring_file, 
+					&stamp, changed,
+					report, length,
+					ep->ubulk->decoded_events, num_events);
+
+		/* and the shared ring, for clients which have mapped it */
+		if (ep->ubulk->input_ring!=NULL) {
+			fill_input_ring(ep->ubulk, report, length);
+			queued++;
+		}
 
 		spin_unlock(&ep->ubulk->read_list_lock);
 
-	} else if (atomic_read(&ep->ubulk->chip->shutdown)!=0){
-		printk(KERN_ERR"%s(): error:%d\n",__FUNCTION__,urb->status);
-	}
+		/* every queued report is a new edge for poll()/epoll() clients, including EPOLLET ones */
+		if (queued!=0) {
+			hdj_wake_up_poll(&ep->ubulk->read_poll_wait, POLLIN | POLLRDNORM);
+		}
 
-hdjbulk_in_urb_complete_bail:
-	atomic_set(&ep->urb_sequence_number,
-			 (atomic_inc_return(&ep->ubulk->current_urb_sequence_number) & 0xFFFF));
-	
-	urb->dev = ep->ubulk->chip->dev;
-	/* this will not try to resubmit if we are shutting down, or suspend has forbidden us to
-	 *  to send requests */
-	hdjbulk_submit_urb(ep->ubulk->chip, urb, GFP_ATOMIC);
+	} else {
+		/* URBs which we killed ourselves are not errors */
+		if (status != -ENOENT && status != -ECONNRESET && 
+		    status != -ESHUTDOWN) {
+			atomic_long_inc(&ep->ubulk->urb_errors);
+		}
+		if (atomic_read(&ep->ubulk->chip->shutdown)!=0) {
+			printk(KERN_ERR"%s(): error:%d\n",__FUNCTION__,status);
+		}
+	}
 }
 
 int send_boot_loader_command(struct usb_hdjbulk *ubulk, u8 boot_loader_command)
@@ -3634,26 +5150,35 @@ static int init_output_control_state(struct usb_hdjbulk *ubulk)
 			goto hdjbulk_init_output_control_state_error;
 		}
 
-		ubulk->output_control_buffer = usb_alloc_coherent(interface_to_usbdev(ubulk->control_interface),
+		ubulk->output_report_buffer = usb_alloc_coherent(interface_to_usbdev(ubulk->control_interface),
 								ubulk->output_control_buffer_size, 
 								GFP_KERNEL,
 								&ubulk->output_control_urb->transfer_dma);
-		if (ubulk->output_control_buffer==NULL) {
+		if (ubulk->output_report_buffer==NULL) {
 			printk(KERN_WARNING"%s() failed to allocate output control usb buffer\n",__FUNCTION__);
 			ret = -ENOMEM;
 			goto hdjbulk_init_output_control_state_error;
 		} else {
-			memset(ubulk->output_control_buffer,0,ubulk->output_control_buffer_size);
+			memset(ubulk->output_report_buffer,0,ubulk->output_control_buffer_size);
 		}
 	} else {
-		ubulk->output_control_buffer = zero_alloc(ubulk->output_control_buffer_size,GFP_KERNEL);
-		if (ubulk->output_control_buffer==NULL) {
-			printk(KERN_WARNING"%s() failed to allocate output control usb buffer\n",__FUNCTION__);
+		ubulk->output_report_buffer = zero_alloc(ubulk->output_control_buffer_size,GFP_KERNEL);
+		if (ubulk->output_report_buffer==NULL) {
+			printk(KERN_WARNING"%s() failed to allocate output control buffer\n",__FUNCTION__);
 			ret = -ENOMEM;
 			goto hdjbulk_init_output_control_state_error;
 		}
 	}
 
+	/* the shadow report, which the above receives a snapshot of for each transfer */
+	ubulk->output_control_buffer = zero_alloc(ubulk->output_control_buffer_size,GFP_KERNEL);
+	if (ubulk->output_control_buffer==NULL) {
+		printk(KERN_WARNING"%s() failed to allocate output control buffer\n",__FUNCTION__);
+		ret = -ENOMEM;
+		goto hdjbulk_init_output_control_state_error;
+	}
+	ubulk->output_report_dirty = 0;
+
 	if (ubulk->chip->product_code == DJCONTROLSTEEL_PRODUCT_CODE) {
 		/* this is bulk not HID */
 		ubulk->output_control_buffer[0] = DJ_STEEL_STANDARD_SET_LED_REPORT;
@@ -3675,14 +5200,112 @@ hdjbulk_init_output_control_state_error:
 	return ret;	
 }
 
+/* returns the number of input URBs requested through the module parameter */
+static int get_default_urb_count(void)
+{
+	if (input_urb_count < DJ_POLL_INPUT_URB_COUNT_MIN) {
+		return DJ_POLL_INPUT_URB_COUNT_MIN;
+	}
+	if (input_urb_count > DJ_POLL_INPUT_URB_COUNT_MAX) {
+		return DJ_POLL_INPUT_URB_COUNT_MAX;
+	}
+	return input_urb_count;
+}
+
+/* 
+ * Allocates the URB of continuous reader endpoint "slot", and fills it to target the endpoint 
+ *  which init_continuous_reader saved.
+ */
+static int alloc_continuous_reader_ep(struct usb_hdjbulk *ubulk, int slot)
+{
+	struct hdjbulk_in_endpoint *ep;
+	struct usb_endpoint_descriptor *endpoint = ubulk->continuous_reader_ep_desc;
+	void* buffer;
+
+	ep = zero_alloc(sizeof(struct hdjbulk_in_endpoint), GFP_KERNEL);
+	if (!ep) {
+		snd_printk(KERN_WARNING"%s() failed to allocate output endpoint\n",__FUNCTION__);
+		return -ENOMEM;
+	}
+	/* save the endpoint's address, so that the caller cleans it up on failure */
+	ubulk->bulk_in_endpoint[slot] = ep;
+
+	ep->interface_number = ubulk->continuous_reader_ifnum;
+	ep->iface = usb_get_intf(ubulk->continuous_reader_iface); 
+	if (ep->iface==NULL) {
+		printk(KERN_WARNING"%s() usb_get_intf failed bailing\n",__FUNCTION__);
+		return -ENOMEM;
+	}
+	ep->ubulk = ubulk;
+	
+	ep->urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!ep->urb) {
+		printk(KERN_WARNING"%s() failed to allocate URB\n",__FUNCTION__);
+		return -ENOMEM;
+	}
+
+	ep->max_transfer = ubulk->continuous_reader_packet_size;
+	buffer = usb_alloc_coherent(ubulk->chip->dev, ep->max_transfer,
+				GFP_KERNEL, &ep->urb->transfer_dma);
+	if (!buffer) {
+		printk(KERN_WARNING"%s() usb_alloc_coherent() failed\n",__FUNCTION__);
+		return -ENOMEM;
+	}
+
+	ep->report_buffer = zero_alloc(2*ep->max_transfer, GFP_KERNEL);
+	if (!ep->report_buffer) {
+		printk(KERN_WARNING"%s() failed to allocate report buffer\n",__FUNCTION__);
+		usb_free_coherent(ubulk->chip->dev, ep->max_transfer, buffer, ep->urb->transfer_dma);
+		return -ENOMEM;
+	}
+
+	atomic_set(&ep->urb_sequence_number,
+		(atomic_inc_return(&ubulk->current_urb_sequence_number) & 0xFFFF));
+
+	if ((endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_INT) {
+		usb_fill_int_urb(ep->urb, 
+			ubulk->chip->dev,
+			ubulk->continuous_reader_pipe,
+			buffer, 
+			ep->max_transfer,
+			hdjbulk_in_urb_complete, 
+			ep,
+			ubulk->continuous_reader_iface->cur_altsetting->endpoint->desc.bInterval);
+	} else {
+		usb_fill_bulk_urb(ep->urb, 
+			ubulk->chip->dev,
+			ubulk->continuous_reader_pipe,
+			buffer, 
+			ep->max_transfer,
+			hdjbulk_in_urb_complete, 
+			ep);
+	}
+
+	ep->urb->transfer_flags = URB_NO_TRANSFER_DMA_MAP;
+	return 0;
+}
+
+/* frees continuous reader endpoint "slot", whose URB must not be in flight */
+static void free_continuous_reader_ep(struct usb_hdjbulk *ubulk, int slot)
+{
+	struct hdjbulk_in_endpoint *ep = ubulk->bulk_in_endpoint[slot];
+
+	if (ep != NULL) {
+		if (ep->iface!=NULL) {
+			usb_put_intf(ep->iface);
+			ep->iface = NULL;
+		}
+		hdjbulk_in_endpoint_delete(ep);
+		ubulk->bulk_in_endpoint[slot] = NULL;
+	}
+}
+
 /* Sets up continuous reader- for some products, targets bulk input endpoint, for others
  *  targets HID input endpoint.*/
 static int init_continuous_reader(struct usb_hdjbulk *ubulk)
 {
 	unsigned int pipe;
 	int i, interface_number, ret=0;
-	struct hdjbulk_in_endpoint *ep[DJ_POLL_INPUT_URB_COUNT];
-	void* buffer;
 	struct usb_host_interface *interface_desc;
 	struct usb_interface *interface=NULL;
 	struct usb_endpoint_descriptor *endpoint;
@@ -3692,12 +5315,14 @@ static int init_continuous_reader(struct usb_hdjbulk *ubulk)
 		return -EINVAL;
 	}
 
-	for (i = 0; i < DJ_POLL_INPUT_URB_COUNT; i++) {
-		ep[i] = NULL;
+	for (i = 0; i < DJ_POLL_INPUT_URB_COUNT_MAX; i++) {
+		ubulk->bulk_in_endpoint[i] = NULL;
 	}
+	ubulk->num_bulk_in_endpoints = 0;
 
 	spin_lock_init(&ubulk->read_list_lock);
 	INIT_LIST_HEAD(&ubulk->open_list);
+	seqcount_init(&ubulk->latest_report_seq);
 	atomic_set(&ubulk->continuous_reader_state,CR_UNINIT);
 
 	if (ubulk->chip->product_code == DJCONTROLSTEEL_PRODUCT_CODE) {
@@ -3747,6 +5372,27 @@ static int init_continuous_reader(struct usb_hdjbulk *ubulk)
 		return -EINVAL;
 	}
 	
+	/* the control table, for DJ_READ_FLAG_EVENTS */
+	if (ubulk->chip->product_code == DJCONTROLSTEEL_PRODUCT_CODE) {
+		ubulk->input_controls = djsteel_input_controls;
+		ubulk->num_input_controls = ARRAY_SIZE(djsteel_input_controls);
+	} else if (ubulk->chip->product_code == DJCONSOLE2_PRODUCT_CODE) {
+		ubulk->input_controls = djconsole2_input_controls;
+		ubulk->num_input_controls = ARRAY_SIZE(djconsole2_input_controls);
+	} else {
+		ubulk->input_controls = djconsole_input_controls;
+		ubulk->num_input_controls = ARRAY_SIZE(djconsole_input_controls);
+	}
+	ubulk->has_relative_controls = 0;
+	for (i = 0; i < ubulk->num_input_controls; i++) {
+		if (ubulk->input_controls[i].type == DJ_CONTROL_TYPE_RELATIVE) {
+			ubulk->has_relative_controls = 1;
+		}
+	}
+	if (ubulk->chip->product_code != DJCONTROLSTEEL_PRODUCT_CODE) {
+		check_hid_input_controls(ubulk, interface, interface_number);
+	}
+	
 	ubulk->reader_cached_buffer = zero_alloc(ubulk->continuous_reader_packet_size,
 													GFP_KERNEL);
 	if (ubulk->reader_cached_buffer==NULL) {
@@ -3754,66 +5400,19 @@ static int init_continuous_reader(struct usb_hdjbulk *ubulk)
 		ret = -ENOMEM;
 		goto init_continuous_reader_error;	
 	}
-	for (i = 0; i < DJ_POLL_INPUT_URB_COUNT; i++) {
-		ep[i] = zero_alloc(sizeof(struct hdjbulk_in_endpoint), GFP_KERNEL);
-		if (!ep[i]) {
-			snd_printk(KERN_WARNING"%s() failed to allocate output endpoint\n",__FUNCTION__);
-			ret = -ENOMEM;
-			goto init_continuous_reader_error;
-		}
-		ep[i]->interface_number = interface_number;
-		ep[i]->iface = usb_get_intf(interface); 
-		if (ep[i]->iface==NULL) {
-			printk(KERN_WARNING"%s() usb_get_intf failed bailing\n",__FUNCTION__);
-			ret = -ENOMEM;
-			goto init_continuous_reader_error;
-		}
-		ep[i]->ubulk = ubulk;
-		
-		ep[i]->urb = usb_alloc_urb(0, GFP_KERNEL);
-		if (!ep[i]->urb) {
-			printk(KERN_WARNING"%s() failed to allocate URB\n",__FUNCTION__);
-			
-			ret = -ENOMEM;
-			goto init_continuous_reader_error;
-		}
-
-		ep[i]->max_transfer = ubulk->continuous_reader_packet_size;
-		buffer = usb_alloc_coherent(ubulk->chip->dev, ep[i]->max_transfer,
-					GFP_KERNEL, &ep[i]->urb->transfer_dma);
-		if (!buffer) {
-			printk(KERN_WARNING"%s() usb_alloc_coherent() failed\n",__FUNCTION__);
-			
-			ret = -ENOMEM;
-			goto init_continuous_reader_error;
-		}
 
-		atomic_set(&ep[i]->urb_sequence_number,
-			(atomic_inc_return(&ubulk->current_urb_sequence_number) & 0xFFFF));
+	/* save the target, so that the number of URBs can be changed later */
+	ubulk->continuous_reader_iface = interface;
+	ubulk->continuous_reader_ifnum = interface_number;
+	ubulk->continuous_reader_pipe = pipe;
+	ubulk->continuous_reader_ep_desc = endpoint;
 
-		if ((endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_INT) {
-			usb_fill_int_urb(ep[i]->urb, 
-				ubulk->chip->dev,
-				pipe,
-				buffer, 
-				ep[i]->max_transfer,
-				hdjbulk_in_urb_complete, 
-				ep[i],
-				interface->cur_altsetting->endpoint->desc.bInterval);
-		} else {
-			usb_fill_bulk_urb(ep[i]->urb, 
-				ubulk->chip->dev,
-				pipe,
-				buffer, 
-				ep[i]->max_transfer,
-				hdjbulk_in_urb_complete, 
-				ep[i]);
+	ubulk->num_bulk_in_endpoints = get_default_urb_count();
+	for (i = 0; i < ubulk->num_bulk_in_endpoints; i++) {
+		ret = alloc_continuous_reader_ep(ubulk, i);
+		if (ret!=0) {
+			goto init_continuous_reader_error;
 		}
-
-		ep[i]->urb->transfer_flags = URB_NO_TRANSFER_DMA_MAP;
-
-		/*save the endpoint's address*/
-		ep[i]->ubulk->bulk_in_endpoint[i] = ep[i];
 	}
 
 	atomic_set(&ubulk->continuous_reader_state,CR_STOPPED);
@@ -3826,16 +5425,10 @@ init_continuous_reader_error:
 		kfree(ubulk->reader_cached_buffer);
 		ubulk->reader_cached_buffer = NULL;
 	}
-	for (i = 0; i < DJ_POLL_INPUT_URB_COUNT; i++) {
-		if (ep[i] != NULL) {
-			if (ep[i]->iface!=NULL) {
-				usb_put_intf(ep[i]->iface);
-				ep[i]->iface = NULL;
-			}
-			hdjbulk_in_endpoint_delete(ep[i]);
-			ep[i]->ubulk->bulk_in_endpoint[i] = NULL;
-		}
+	for (i = 0; i < DJ_POLL_INPUT_URB_COUNT_MAX; i++) {
+		free_continuous_reader_ep(ubulk, i);
 	}
+	ubulk->num_bulk_in_endpoints = 0;
 	return ret;
 }
 
@@ -4212,7 +5805,7 @@ int hdjbulk_init_dj_steel(struct usb_hdjbulk *ubulk)
 
 int start_continuous_reader(struct usb_hdjbulk *ubulk)
 {
-	int i,rc, old_state;
+	int i,rc=0, old_state;
 	if (is_continuous_reader_supported(ubulk->chip)==0) {
 		printk(KERN_WARNING"%s invalid product:%d\n",__FUNCTION__,ubulk->chip->product_code);
 		return -EINVAL;
@@ -4223,7 +5816,7 @@ int start_continuous_reader(struct usb_hdjbulk *ubulk)
 		printk(KERN_INFO"%s() operation already in progress, or bad state\n",__FUNCTION__);
 		return 0;
 	}
-	for (i = 0; i < DJ_POLL_INPUT_URB_COUNT; i++) {
+	for (i = 0; i < ubulk->num_bulk_in_endpoints; i++) {
 		rc = hdjbulk_input_start_ep(ubulk->bulk_in_endpoint[i]);
 		if (rc!=0) {
 			printk(KERN_ERR"%s() hdjbulk_input_start_ep failed, rc:%d",
@@ -4250,6 +5843,74 @@ int stop_continuous_reader(struct usb_hdjbulk *ubulk)
 	return 0;
 }
 
+/* 
+ * Changes the number of URBs which the continuous reader keeps in flight.  If the reader is
+ *  running it is stopped, and restarted once the URBs have been added or freed.
+ */
+int set_continuous_reader_urb_count(struct usb_hdjbulk *ubulk, int count)
+{
+	int i, ret = 0, was_started;
+
+	if (is_continuous_reader_supported(ubulk->chip)==0) {
+		return -ENXIO;
+	}
+
+	if (count < DJ_POLL_INPUT_URB_COUNT_MIN || count > DJ_POLL_INPUT_URB_COUNT_MAX) {
+		printk(KERN_WARNING"%s() invalid URB count:%d\n",__FUNCTION__,count);
+		return -EINVAL;
+	}
+
+	down(&ubulk->continuous_reader_mutex);
+	if (count == ubulk->num_bulk_in_endpoints) {
+		goto set_continuous_reader_urb_count_bail;
+	}
+
+	was_started = (atomic_read(&ubulk->continuous_reader_state)==CR_STARTED);
+	stop_continuous_reader(ubulk);
+	if (atomic_read(&ubulk->continuous_reader_state)!=CR_STOPPED) {
+		printk(KERN_INFO"%s() bad state for continuous reader, bailing\n",__FUNCTION__);
+		ret = -EBUSY;
+		goto set_continuous_reader_urb_count_bail;
+	}
+
+	for (i = ubulk->num_bulk_in_endpoints; i < count; i++) {
+		ret = alloc_continuous_reader_ep(ubulk, i);
+		if (ret!=0) {
+			printk(KERN_WARNING"%s() alloc_continuous_reader_ep failed, rc:%d\n",
+				__FUNCTION__,ret);
+			break;
+		}
+	}
+
+	if (ret!=0) {
+		/* keep the URBs which we had */
+		for (i = ubulk->num_bulk_in_endpoints; i < count; i++) {
+			free_continuous_reader_ep(ubulk, i);
+		}
+	} else {
+		for (i = count; i < ubulk->num_bulk_in_endpoints; i++) {
+			free_continuous_reader_ep(ubulk, i);
+		}
+		ubulk->num_bulk_in_endpoints = count;
+	}
+
+	if (was_started!=0) {
+		start_continuous_reader(ubulk);
+	}
+
+set_continuous_reader_urb_count_bail:
+	up(&ubulk->continuous_reader_mutex);
+	return ret;
+}
+
+int get_continuous_reader_urb_count(struct usb_hdjbulk *ubulk)
+{
+	if (is_continuous_reader_supported(ubulk->chip)==0) {
+		return -ENXIO;
+	}
+	return ubulk->num_bulk_in_endpoints;
+}
+
 /*
  * Frees an output endpoint.
  * May be called when ep hasn't been initialized completely.
@@ -4265,6 +5926,9 @@ void hdjbulk_in_endpoint_delete(struct hdjbulk_in_endpoint* ep)
 		usb_free_urb(ep->urb);
 		ep->urb = NULL;
 	}
+	if (ep->report_buffer) {
+		kfree(ep->report_buffer);
+	}
 	kfree(ep);
 }
 
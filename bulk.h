@@ -47,6 +47,19 @@ extern u32 driver_version;
 #define USB_HID_OUTPUT_REPORT				2
 #define USB_HID_FEATURE_REPORT				3
 
+/* for cross-checking the input control tables of our HID consoles with their report descriptors */
+#define HDJ_DT_HID							0x21
+#define HDJ_DT_HID_REPORT					0x22
+#define HDJ_HID_REPORT_DESC_MAX_LEN			1024
+#define HDJ_HID_ITEM_LONG					0xfe
+#define HDJ_HID_ITEM_INPUT					0x80 /* main items, less the data size bits */
+#define HDJ_HID_ITEM_REPORT_SIZE			0x74 /* global items */
+#define HDJ_HID_ITEM_REPORT_ID				0x84
+#define HDJ_HID_ITEM_REPORT_COUNT			0x94
+#define HDJ_HID_INPUT_CONSTANT				0x01 /* input item data */
+#define HDJ_HID_INPUT_VARIABLE				0x02
+#define HDJ_HID_INPUT_RELATIVE				0x04
+
 /* output set report buffer sizes, including report ID */
 #define DJC_SET_REPORT_LEN					4
 #define DJMK2_SET_REPORT_LEN				4
@@ -57,30 +70,110 @@ extern u32 driver_version;
 #define DJMK2_SET_REPORT_ID					1
 #define DJRMX_SET_REPORT_ID					1
 
+/*
+ * Per file state, allocated at open and kept in file->private_data until release.  For products
+ *  with a continuous reader it is also linked into the device's open_list.
+ */
 struct hdj_open_list {
 	struct list_head	list;
 	struct file			*file;
+	int					chip_index;
 	u8					is_releasing;
 	long				access_count;
-	struct list_head	read_list;
+	u32					read_flags; /* DJ_READ_FLAG_* */
+	unsigned long		keyframe_interval; /* in jiffies, 0 for none */
+	struct hdj_read_list *reader; /* the file's own cursor, shared by all threads */
+	unsigned long		num_thread_cursors; /* added through DJ_IOCTL_ADD_READ_CURSOR */
+	struct list_head	read_list; /* every cursor of the file, including reader */
 };
 
+/*
+ * Each reader owns a ring of input reports.  The URB completion is the only producer and
+ *  only moves ring_head; the reader is the only consumer and only moves ring_tail.  The one
+ *  exception is overrun, where the producer discards the oldest report by advancing ring_tail
+ *  with cmpxchg, so a consumer which loses that race simply retries with the next report.
+ */
 struct hdj_read_list {
 	struct list_head	list;
-	struct completion	read_completion;
-	long				thread_id;
-	struct list_head	list_buffers;
-	atomic_t			num_pending_waits;
+	wait_queue_head_t	read_wait; /* every thread blocked in read on this cursor */
+	long				thread_id; /* owner of an additional cursor, 0 for the file's own */
+	u8					*ring;
+	unsigned long		ring_mask; /* ring depth - 1, the depth is a power of 2 */
+	unsigned long		ring_head;
+	unsigned long		ring_tail;
+	unsigned long		last_queued_jiffies; /* for keyframes in change-only mode */
+	unsigned long		latest_seen; /* latest_report_count when last read in latest mode */
+	/* decoded controls for DJ_READ_FLAG_EVENTS, a ring with the same protocol as the above */
+	struct dj_control_event *events;
+	unsigned long		event_mask;
+	unsigned long		event_head;
+	unsigned long		event_tail;
+	/* statistics- the producer owns the first three, see struct dj_reader_stats */
+	unsigned long		queued;
+	unsigned long		dropped;
+	unsigned long		max_depth;
+	atomic_long_t		delivered;
 };
 
-#define HDJ_READ_BUFFERS_COUNT		15UL
+/* per reader ring depth, can be overridden with the reader_queue_depth module parameter */
+#define HDJ_READ_RING_DEPTH_DEFAULT	16UL
+#define HDJ_READ_RING_DEPTH_MIN		2UL
+#define HDJ_READ_RING_DEPTH_MAX		256UL
 #define HDJ_POLL_INPUT_BUFFER_SIZE	64UL
-struct hdj_read_buffers {
-	struct list_head	list;
-	u8			buffer[HDJ_POLL_INPUT_BUFFER_SIZE];
-	u8			is_ready;
+/* each ring slot holds a report, preceded by the timestamp taken on completion */
+#define HDJ_READ_RING_SLOT_SIZE		(sizeof(struct dj_read_timestamp_header) + \
+									 HDJ_POLL_INPUT_BUFFER_SIZE)
+/* per reader event ring depth, a power of 2 */
+#define HDJ_EVENT_RING_DEPTH		256UL
+/* a failed asynchronous output report is retried this many times, at least this far apart */
+#define HDJ_OUTPUT_REPORT_RETRIES	3
+#define HDJ_OUTPUT_REPORT_RETRY_NS	(10*NSEC_PER_MSEC)
+
+/* 
+ * A control of the input report, or for DJ_CONTROL_TYPE_BYTE and DJ_CONTROL_TYPE_STATE a run of
+ *  bytes which are decoded as controls of the same type.
+ */
+struct hdj_input_control {
+	u16	control_id; /* DJ_CONTROL_ID() of the control, or of the run's first byte */
+	u8	type; /* DJ_CONTROL_TYPE_* */
+	u8	byte_number;
+	u8	num_bytes; /* of the run, or of an absolute or relative control (1 or 2) */
+	u8	bit_number; /* buttons and flags only */
+	u8	report_id; /* the report which holds the control, 0 if reports are not numbered */
 };
 
+/* most controls which a product's table may hold */
+#define HDJ_MAX_INPUT_CONTROLS		128
+
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0) )
+#define hdj_read_once(x)	READ_ONCE(x)
+#else
+#define hdj_read_once(x)	ACCESS_ONCE(x)
+#endif
+
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0) )
+#define hdj_ktime_get_ns()	ktime_get_ns()
+#else
+#define hdj_ktime_get_ns()	ktime_to_ns(ktime_get())
+#endif
+
+#ifndef POLLRDHUP
+#define POLLRDHUP			0x2000
+#endif
+
+/* what poll() reports once the device has been unplugged, or the file is being released */
+#define HDJ_POLL_HANGUP_MASK	(POLLERR | POLLHUP | POLLRDHUP)
+
+/* 
+ * Wakes up poll()/epoll() waiters.  Keyed wakeups let epoll skip entries which did not ask 
+ *  for the events being signalled.
+ */
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30) )
+#define hdj_wake_up_poll(wq,mask)	wake_up_interruptible_poll(wq,mask)
+#else
+#define hdj_wake_up_poll(wq,mask)	wake_up_interruptible(wq)
+#endif
+
 struct hdj_common_context {
 	/*Common Settings:*/
 
@@ -170,9 +263,16 @@ struct hdjbulk_in_endpoint {
 	struct urb* urb;
 	atomic_t urb_sequence_number;
 	int max_transfer;		/* size of urb buffer */
+	/* two copies of max_transfer bytes, which the completion alternates between, so that
+	 *  the URB can be resubmitted before the report is processed */
+	u8 *report_buffer;
+	int report_index;
 };
 
-#define DJ_POLL_INPUT_URB_COUNT	2
+/* number of URBs which the continuous reader keeps in flight */
+#define DJ_POLL_INPUT_URB_COUNT		2	/* default */
+#define DJ_POLL_INPUT_URB_COUNT_MIN	2
+#define DJ_POLL_INPUT_URB_COUNT_MAX	32
 
 /* continuous reader state */
 #define CR_UNINIT		0
@@ -216,8 +316,25 @@ struct usb_hdjbulk {
 	*	Continuous reader support- this could represent polling the input bulk 
 	*       interface on the DJ Control Steel, or the HID interface on another product
 	************************************************************************************/
-	struct hdjbulk_in_endpoint *bulk_in_endpoint[DJ_POLL_INPUT_URB_COUNT];
+	struct hdjbulk_in_endpoint *bulk_in_endpoint[DJ_POLL_INPUT_URB_COUNT_MAX];
+	int		num_bulk_in_endpoints;
+	/* what every URB of the continuous reader targets, saved so that more can be added */
+	struct usb_interface	*continuous_reader_iface;
+	int		continuous_reader_ifnum;
+	unsigned int	continuous_reader_pipe;
+	struct usb_endpoint_descriptor *continuous_reader_ep_desc;
+	/* serializes suspend/resume with changes of the number of URBs */
+	struct semaphore	continuous_reader_mutex;
 	u8 *reader_cached_buffer;
+	/* newest report with its timestamp, for readers in DJ_READ_FLAG_LATEST mode */
+	seqcount_t	latest_report_seq;
+	unsigned long	latest_report_count;
+	u8		latest_report[HDJ_READ_RING_SLOT_SIZE];
+	/* control table of the product, and the events decoded from the current report */
+	const struct hdj_input_control *input_controls;
+	int		num_input_controls;
+	u8		has_relative_controls;
+	struct dj_control_event decoded_events[HDJ_MAX_INPUT_CONTROLS];
 	/* list for maintaining state of clients for read */
 	spinlock_t	read_list_lock;
 	struct list_head open_list;
@@ -225,6 +342,10 @@ struct usb_hdjbulk {
 	atomic_t	continuous_reader_state;
 	/* sequence number for URBs- no action taken yet if comepletion occurs out of order */
 	atomic_t	expected_urb_sequence_number;
+	/* input error totals, see struct dj_reader_stats */
+	atomic_long_t	urb_errors;
+	atomic_long_t	urb_sequence_gaps;
+	atomic_long_t	device_sequence_gaps;
 	u32		continuous_reader_packet_size;
 
 	/* Output buffer size for setting control information to the device */
@@ -236,9 +357,30 @@ struct usb_hdjbulk {
 	struct 		usb_ctrlrequest* output_control_ctl_req; /* setup packet for our control requests */
 	dma_addr_t 	output_control_dma;
 	struct 		completion output_control_completion;
+	/* Asynchronous output- output_control_buffer is the shadow report which updates are merged
+	 *  into, and the worker sends a snapshot of it from output_report_buffer */
+	u8*		output_report_buffer;
+	struct 		semaphore output_report_mutex; /* serializes output_report_buffer transfers */
+	int		output_report_dirty; /* protected by output_control_mutex */
+	int		output_report_retries; /* of the pending report, protected by output_report_mutex */
+	/* last failure of an asynchronous report, returned by the next update, protected by 
+	 *  output_control_mutex */
+	int		output_report_error;
+	struct work_struct output_report_work;
+	struct hrtimer	output_report_timer; /* schedules the worker once the output bucket allows */
 
 	/* support for read poll/select */
 	wait_queue_head_t       read_poll_wait;
+
+	/* shared input report ring, allocated on first mmap- protected by read_list_lock in 
+	 *  the completion routine.  The head is kept here as the mapping is user writable. */
+	struct dj_input_ring_header *input_ring;
+	u32			input_ring_head;
+	struct semaphore	input_ring_mutex;
+	/* the one file whose mappings of the ring are live, NULL if unmapped.  Its reads are 
+	 *  not queued, as it reads the ring.  Changed under both locks. */
+	struct file		*input_ring_file;
+	int			input_ring_map_count; /* protected by input_ring_mutex */
 };
 
 #define to_hdjbulk_dev(d) container_of(d, struct usb_hdjbulk, kref)
@@ -255,7 +397,11 @@ void hdj_delete(struct kref *kref);
 int hdjbulk_open(struct inode *inode, struct file *file);
 int hdjbulk_release(struct inode *inode, struct file *file);
 ssize_t hdjbulk_read (struct file *, char __user *, size_t, loff_t *);
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0) )
+ssize_t hdjbulk_read_iter (struct kiocb *, struct iov_iter *);
+#endif
 unsigned int hdjbulk_poll (struct file *, struct poll_table_struct *);
+int hdjbulk_mmap(struct file *file, struct vm_area_struct *vma);
 long hdjbulk_ioctl(struct file *file,	
 					 unsigned int ioctl_num,	
 					 unsigned long ioctl_param,
@@ -295,6 +441,9 @@ void unlock_bulk_output_io(struct usb_hdjbulk *ubulk);
 /* Sends output report already prepared in output_control_buffer, caller must synchronize with
  *  output_control_mutex */
 int usb_set_report(struct usb_hdjbulk *ubulk, u8 type, u8 id);
+/* Schedules the transfer of output_control_buffer, caller must synchronize with 
+ *  output_control_mutex */
+void queue_output_report(struct usb_hdjbulk *ubulk);
 
 /*
  * Creates and registers everything needed for a MIDI streaming interface.
@@ -331,6 +480,10 @@ void hdjbulk_input_kill_urbs(struct hdjbulk_in_endpoint* ep);
 u8 is_continuous_reader_supported(struct snd_hdj_chip* chip);
 int start_continuous_reader(struct usb_hdjbulk *ubulk);
 int stop_continuous_reader(struct usb_hdjbulk *ubulk);
+int set_continuous_reader_urb_count(struct usb_hdjbulk *ubulk, int count);
+int get_continuous_reader_urb_count(struct usb_hdjbulk *ubulk);
+int get_input_stats_totals(struct usb_hdjbulk *ubulk, struct dj_reader_stats *stats, 
+							u32 *num_readers);
 
 /*
  * get the data from the bulk endpoint
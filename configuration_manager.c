@@ -25,6 +25,12 @@
 #include <linux/errno.h>
 #include <linux/usb.h>
 #include <linux/version.h>	/* For LINUX_VERSION_CODE */
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/module.h>
 #include <asm/atomic.h>
 #if ( LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35) )
 #include <linux/slab.h>
@@ -47,6 +53,10 @@
 #include "callback.h"
 #include "hdjmp3.h"
 
+static unsigned int output_shadow_flush_hz = 100;
+module_param(output_shadow_flush_hz, uint, 0644);
+MODULE_PARM_DESC(output_shadow_flush_hz, "Checks per second of a mapped output control page for updates (1-1000).");
+
 /* The firmware is used for verification purposes
  * set midi_channel to MIDI_INVALID_CHANNEL if you want it to be
  * queried from the hardware
@@ -1628,6 +1638,8 @@ int clear_leds(struct snd_hdj_chip* chip)
 			ep->controller_state->output_control_ctl_urb->dev = ep->umidi->chip->dev;
 			ep->controller_state->output_control_ctl_urb->transfer_buffer_length = data_len;
 			
+			/* share the output rate with MIDI render */
+			hdj_output_bucket_sleep(&chip->output_bucket);
 			rc = snd_hdjmidi_submit_urb(ep->umidi, 
 					ep->controller_state->output_control_ctl_urb, GFP_KERNEL);
 			if (rc!=0) {
@@ -1659,8 +1671,6 @@ int clear_leds(struct snd_hdj_chip* chip)
 
 					rc = -EPIPE;
 				}
-				/* required or next access may fail */
-				msleep(10);	
 			}
 			up(&ep->controller_state->output_control_ctl_mutex);
 		} else {
@@ -1766,6 +1776,8 @@ int set_mouse_state(struct snd_hdj_chip* chip, u8 enable_mouse)
 			ep->controller_state->output_control_ctl_urb->dev = ep->umidi->chip->dev;
 			ep->controller_state->output_control_ctl_urb->transfer_buffer_length = data_len;
 			
+			/* share the output rate with MIDI render */
+			hdj_output_bucket_sleep(&chip->output_bucket);
 			ret = snd_hdjmidi_submit_urb(ep->umidi, ep->controller_state->output_control_ctl_urb, GFP_KERNEL);
 			if (ret!=0) {
 				printk(KERN_WARNING"%s snd_hdjmidi_submit_urb() failed, rc:%d\n",__FUNCTION__,ret);
@@ -1795,8 +1807,6 @@ int set_mouse_state(struct snd_hdj_chip* chip, u8 enable_mouse)
 
 					ret = -EPIPE;
 				}
-				/* required or next access may fail */
-				msleep(10);	
 			}
 			up(&ep->controller_state->output_control_ctl_mutex);
 		} else {
@@ -2013,22 +2023,12 @@ int send_control_output_report(struct snd_hdj_chip* chip,
 			}
 		}
 		
-		/* now send the data */
-		if (ubulk->chip->product_code == DJCONSOLE_PRODUCT_CODE) {
-			rc = usb_set_report(ubulk,USB_HID_OUTPUT_REPORT,DJC_SET_REPORT_ID);
-		} else if (ubulk->chip->product_code == DJCONSOLE2_PRODUCT_CODE) {
-			rc = usb_set_report(ubulk,USB_HID_OUTPUT_REPORT,DJMK2_SET_REPORT_ID);
-		} else if (ubulk->chip->product_code == DJCONSOLERMX_PRODUCT_CODE) {
-			rc = usb_set_report(ubulk,USB_HID_OUTPUT_REPORT,DJRMX_SET_REPORT_ID);
-		} else if (ubulk->chip->product_code == DJCONTROLSTEEL_PRODUCT_CODE) {
-			rc = send_bulk_write(ubulk,
-						ubulk->output_control_buffer,
-						ubulk->output_control_buffer_size,
-						0 /*force_send*/);
-		} else {
-			printk(KERN_WARNING"%s() invalid product:%d\n",__FUNCTION__,ubulk->chip->product_code);
-			rc = -EINVAL;
-		}
+		/* Now send the data, asynchronously- updates which arrive before the worker runs are
+		 *  merged into the same report */
+		queue_output_report(ubulk);
+		/* this update is queued either way, but the caller learns that an earlier one failed */
+		rc = ubulk->output_report_error;
+		ubulk->output_report_error = 0;
 		up(&ubulk->output_control_mutex);	
 	}  else if (chip->product_code==DJCONTROLLER_PRODUCT_CODE) {
 		umidi = midi_from_chip(chip);
@@ -2080,6 +2080,8 @@ int send_control_output_report(struct snd_hdj_chip* chip,
 		}
 		controller_state->output_control_ctl_urb->dev = ep->umidi->chip->dev;
 		controller_state->output_control_ctl_urb->transfer_buffer_length = data_len;
+		/* share the output rate with MIDI render */
+		hdj_output_bucket_sleep(&chip->output_bucket);
 		rc = snd_hdjmidi_submit_urb(umidi, controller_state->output_control_ctl_urb, GFP_KERNEL);
 		if (rc!=0) {
 			printk(KERN_WARNING"%s snd_hdjmidi_submit_urb() failed, rc:%d\n",__FUNCTION__,rc);
@@ -2107,8 +2109,6 @@ int send_control_output_report(struct snd_hdj_chip* chip,
 								controller_state->output_control_ctl_pipe);
 				rc = -EPIPE;
 			}	
-			/* required or next access may fail */
-			msleep(10);
 		}
 		up(&controller_state->output_control_ctl_mutex);
 	} else {
@@ -2126,6 +2126,363 @@ int send_control_output_report(struct snd_hdj_chip* chip,
 	return rc;
 }
 
+int send_control_output_vector(struct snd_hdj_chip* chip, 
+								void __user *vector)
+{
+	struct dj_output_control_vector header;
+	u8 *entries=NULL, *merged=NULL;
+	u8 *data, *mask;
+	u64 deadline_ns, now;
+	u32 control_len, entry_size, i, curr_byte;
+	int applied = 0;
+	int rc;
+
+	rc = get_output_control_data_len(chip,&control_len);
+	if (rc!=0) {
+		printk(KERN_WARNING"%s() get_output_control_data_len() failed, rc:%d\n",
+				__FUNCTION__,rc);
+		return rc;	
+	}
+
+	if (copy_from_user(&header, vector, sizeof(header)) != 0) {
+		printk(KERN_WARNING"%s() copy_from_user failed for header\n",__FUNCTION__);
+		return -EFAULT;
+	}
+	if (header.count==0 || header.count > DJ_OUTPUT_CONTROL_VECTOR_MAX) {
+		printk(KERN_WARNING"%s() invalid count:%u\n",__FUNCTION__,header.count);
+		return -EINVAL;
+	}
+
+	entry_size = sizeof(struct dj_output_control_entry) + control_len*2;
+	entries = kmalloc(header.count*entry_size, GFP_KERNEL);
+	merged = zero_alloc(control_len*2, GFP_KERNEL);
+	if (entries==NULL || merged==NULL) {
+		printk(KERN_WARNING"%s() kmalloc failed\n",__FUNCTION__);
+		rc = -ENOMEM;
+		goto send_control_output_vector_bail;
+	}
+	if (copy_from_user(entries, (u8 __user *)vector + sizeof(header), 
+				header.count*entry_size) != 0) {
+		printk(KERN_WARNING"%s() copy_from_user failed for entries\n",__FUNCTION__);
+		rc = -EFAULT;
+		goto send_control_output_vector_bail;
+	}
+
+	/* fold the entries into one data and mask pair, later entries winning */
+	now = hdj_ktime_get_ns();
+	for (i=0;i<header.count;i++) {
+		/* the entries are packed, so the deadline may be unaligned */
+		memcpy(&deadline_ns, entries + i*entry_size, sizeof(deadline_ns));
+		if (deadline_ns!=0 && deadline_ns < now) {
+			continue;
+		}
+		data = entries + i*entry_size + sizeof(struct dj_output_control_entry);
+		mask = data + control_len;
+		for (curr_byte=0;curr_byte<control_len;curr_byte++) {
+			merged[curr_byte] = (merged[curr_byte] & ~mask[curr_byte]) | 
+								(data[curr_byte] & mask[curr_byte]);
+			merged[control_len+curr_byte] |= mask[curr_byte];
+		}
+		applied++;
+	}
+
+	/* if every entry is stale there is nothing to send */
+	if (applied!=0) {
+		rc = send_control_output_report(chip, merged, control_len*2);
+	}
+
+send_control_output_vector_bail:
+	if (entries!=NULL) {
+		kfree(entries);
+	}
+	if (merged!=NULL) {
+		kfree(merged);
+	}
+	return rc;
+}
+
+/* driver side state of the shared output control page */
+struct hdj_output_shadow {
+	struct snd_hdj_chip *chip;
+	struct dj_output_shadow_header *page;	/* mapped by clients */
+	u32 map_size;
+	u32 control_len;
+	u8 *masked_buffer;	/* data and mask, as passed to send_control_output_report() */
+	u32 flushed_generation;
+	int map_count;	/* protected by the chip's output_shadow_mutex */
+	struct hrtimer timer;
+	struct work_struct work;
+};
+
+static u32 output_shadow_map_size(u32 control_len)
+{
+	return PAGE_ALIGN(sizeof(struct dj_output_shadow_header) + control_len*2);
+}
+
+int get_output_shadow_map_size(struct snd_hdj_chip* chip, u32* size)
+{
+	u32 control_len;
+	int rc;
+
+	rc = get_output_control_data_len(chip,&control_len);
+	if (rc==0) {
+		*size = output_shadow_map_size(control_len);
+	}
+	return rc;
+}
+
+static u32 output_shadow_interval_us(void)
+{
+	unsigned int hz = output_shadow_flush_hz;
+
+	if (hz < 1) {
+		hz = 1;
+	} else if (hz > 1000) {
+		hz = 1000;
+	}
+	return USEC_PER_SEC/hz;
+}
+
+/* sends the page if the client changed it since the last flush */
+static void flush_output_shadow(struct hdj_output_shadow *shadow)
+{
+	u32 generation;
+	int rc;
+
+	generation = hdj_read_once(shadow->page->generation);
+	if (generation==shadow->flushed_generation) {
+		return;
+	}
+	/* while I/O is forbidden the update stays pending, it goes out once I/O resumes */
+	if (atomic_read(&shadow->chip->no_urb_submission)!=0 ||
+		atomic_read(&shadow->chip->shutdown)!=0) {
+		return;
+	}
+
+	/* pairs with the client's write barrier before it increments generation */
+	smp_rmb();
+	memcpy(shadow->masked_buffer,
+			(u8*)shadow->page + sizeof(struct dj_output_shadow_header),
+			shadow->control_len*2);
+	rc = send_control_output_report(shadow->chip, shadow->masked_buffer, shadow->control_len*2);
+
+	/* a failed update is not retried at the flush rate, but only once the page changes again */
+	shadow->flushed_generation = generation;
+	if (rc==0) {
+		shadow->page->flushed_generation = generation;
+	} else {
+		printk(KERN_WARNING"%s() send_control_output_report() failed, rc:%d\n",
+				__FUNCTION__,rc);
+	}
+}
+
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20) )
+static void output_shadow_work(struct work_struct *work)
+{
+	flush_output_shadow(container_of(work, struct hdj_output_shadow, work));
+}
+#else
+static void output_shadow_work(void *data)
+{
+	flush_output_shadow(data);
+}
+#endif
+
+static enum hrtimer_restart output_shadow_timer(struct hrtimer *timer)
+{
+	struct hdj_output_shadow *shadow = container_of(timer, struct hdj_output_shadow, timer);
+	u32 interval_us = output_shadow_interval_us();
+
+	/* the flush sleeps, so it is left to the worker */
+	if (hdj_read_once(shadow->page->generation)!=shadow->flushed_generation) {
+		schedule_work(&shadow->work);
+	}
+
+	/* the rate may be changed at any time through the module parameter */
+	shadow->page->flush_interval_us = interval_us;
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,25) )
+	hrtimer_forward_now(timer, ns_to_ktime((u64)interval_us*NSEC_PER_USEC));
+#else
+	hrtimer_forward(timer, ktime_get(), ns_to_ktime((u64)interval_us*NSEC_PER_USEC));
+#endif
+	return HRTIMER_RESTART;
+}
+
+/* ALERT: output_shadow_mutex needs to be acquired before calling */
+static void start_output_shadow(struct hdj_output_shadow *shadow)
+{
+	u32 interval_us = output_shadow_interval_us();
+
+	shadow->page->flush_interval_us = interval_us;
+	hrtimer_start(&shadow->timer, ns_to_ktime((u64)interval_us*NSEC_PER_USEC), 
+			HRTIMER_MODE_REL);
+}
+
+static void cancel_output_shadow(struct hdj_output_shadow *shadow)
+{
+	hrtimer_cancel(&shadow->timer);
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22) )
+	cancel_work_sync(&shadow->work);
+#else
+	flush_scheduled_work();
+#endif
+}
+
+/* ALERT: output_shadow_mutex needs to be acquired before calling */
+static void stop_output_shadow(struct hdj_output_shadow *shadow)
+{
+	cancel_output_shadow(shadow);
+	/* the last stores before the page was unmapped still go out */
+	flush_output_shadow(shadow);
+}
+
+/* The timer runs only while at least one client has the page mapped.  Each mapping holds a
+ *  chip reference, so the chip and the shadow outlive it even when the device is unplugged,
+ *  and the last unmap may free both. */
+static void output_shadow_vm_open(struct vm_area_struct *vma)
+{
+	struct hdj_output_shadow *shadow = vma->vm_private_data;
+
+	/* the mapping which is being copied holds a reference */
+	hold_chip_ref_count(shadow->chip);
+	down(&shadow->chip->output_shadow_mutex);
+	if (shadow->map_count++ == 0) {
+		start_output_shadow(shadow);
+	}
+	up(&shadow->chip->output_shadow_mutex);
+}
+
+static void output_shadow_vm_close(struct vm_area_struct *vma)
+{
+	struct hdj_output_shadow *shadow = vma->vm_private_data;
+	struct snd_hdj_chip* chip = shadow->chip;
+
+	down(&chip->output_shadow_mutex);
+	if (--shadow->map_count == 0) {
+		stop_output_shadow(shadow);
+	}
+	up(&chip->output_shadow_mutex);
+	/* may tear the chip down, and free the shadow with it */
+	dec_chip_ref_count(chip->index);
+}
+
+static const struct vm_operations_struct output_shadow_vm_ops = {
+	.open =		output_shadow_vm_open,
+	.close =	output_shadow_vm_close,
+};
+
+/* ALERT: output_shadow_mutex needs to be acquired before calling */
+static int alloc_output_shadow(struct snd_hdj_chip* chip)
+{
+	struct hdj_output_shadow *shadow;
+	u32 control_len;
+	int rc;
+
+	rc = get_output_control_data_len(chip,&control_len);
+	if (rc!=0) {
+		printk(KERN_WARNING"%s() get_output_control_data_len() failed, rc:%d\n",
+				__FUNCTION__,rc);
+		return rc;
+	}
+
+	shadow = zero_alloc(sizeof(struct hdj_output_shadow), GFP_KERNEL);
+	if (shadow==NULL) {
+		printk(KERN_WARNING"%s() kmalloc failed\n",__FUNCTION__);
+		return -ENOMEM;
+	}
+	shadow->chip = chip;
+	shadow->control_len = control_len;
+	shadow->map_size = output_shadow_map_size(control_len);
+	shadow->masked_buffer = kmalloc(control_len*2, GFP_KERNEL);
+	/* vmalloc_user zeroes the memory */
+	shadow->page = vmalloc_user(shadow->map_size);
+	if (shadow->masked_buffer==NULL || shadow->page==NULL) {
+		printk(KERN_WARNING"%s() allocation failed\n",__FUNCTION__);
+		if (shadow->page!=NULL) {
+			vfree(shadow->page);
+		}
+		if (shadow->masked_buffer!=NULL) {
+			kfree(shadow->masked_buffer);
+		}
+		kfree(shadow);
+		return -ENOMEM;
+	}
+	shadow->page->version = DJ_OUTPUT_SHADOW_VERSION;
+	shadow->page->header_size = sizeof(struct dj_output_shadow_header);
+	shadow->page->control_size = control_len;
+
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(6,15,0) )
+	hrtimer_setup(&shadow->timer, output_shadow_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&shadow->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	shadow->timer.function = output_shadow_timer;
+#endif
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20) )
+	INIT_WORK(&shadow->work, output_shadow_work);
+#else
+	INIT_WORK(&shadow->work, output_shadow_work, shadow);
+#endif
+
+	chip->output_shadow = shadow;
+	return 0;
+}
+
+int map_output_shadow(struct snd_hdj_chip* chip, struct vm_area_struct *vma)
+{
+	struct hdj_output_shadow *shadow;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int rc = 0;
+
+	down(&chip->output_shadow_mutex);
+	if (chip->output_shadow==NULL) {
+		rc = alloc_output_shadow(chip);
+		if (rc!=0) {
+			goto map_output_shadow_bail;
+		}
+	}
+	shadow = chip->output_shadow;
+
+	if (size > shadow->map_size) {
+		printk(KERN_WARNING"%s() invalid mapping size:%lu\n",__FUNCTION__,size);
+		rc = -EINVAL;
+		goto map_output_shadow_bail;
+	}
+
+	rc = remap_vmalloc_range(vma, shadow->page, 0);
+	if (rc!=0) {
+		printk(KERN_WARNING"%s() remap_vmalloc_range failed, rc:%d\n",__FUNCTION__,rc);
+		goto map_output_shadow_bail;
+	}
+	vma->vm_ops = &output_shadow_vm_ops;
+	vma->vm_private_data = shadow;
+	/* the mapping's reference, the caller holds its own */
+	hold_chip_ref_count(chip);
+	if (shadow->map_count++ == 0) {
+		start_output_shadow(shadow);
+	}
+
+map_output_shadow_bail:
+	up(&chip->output_shadow_mutex);
+	return rc;
+}
+
+/* Called by the chip destructor.  Every mapping holds a chip reference, so this only runs
+ *  once the last client has unmapped the page. */
+void free_output_shadow(struct snd_hdj_chip* chip)
+{
+	struct hdj_output_shadow *shadow = chip->output_shadow;
+
+	if (shadow==NULL) {
+		return;
+	}
+	/* the timer stopped with the last mapping, but make sure */
+	cancel_output_shadow(shadow);
+	vfree(shadow->page);
+	kfree(shadow->masked_buffer);
+	kfree(shadow);
+	chip->output_shadow = NULL;
+}
+
 int get_control_output_report(struct snd_hdj_chip* chip, 
 								u8 __user *buffer,
 								u32 buffer_len)
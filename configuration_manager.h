@@ -31,6 +31,13 @@ int get_input_control_data_len(struct snd_hdj_chip* chip, u32* len);
 int send_control_output_report(struct snd_hdj_chip* chip, 
 								u8 *masked_buffer,
 								u32 buffer_len);
+/* applies the updates of a struct dj_output_control_vector, and sends the result once */
+int send_control_output_vector(struct snd_hdj_chip* chip, 
+								void __user *vector);
+/* shared output control page, see struct dj_output_shadow_header */
+int get_output_shadow_map_size(struct snd_hdj_chip* chip, u32* size);
+int map_output_shadow(struct snd_hdj_chip* chip, struct vm_area_struct *vma);
+void free_output_shadow(struct snd_hdj_chip* chip);
 int get_control_output_report(struct snd_hdj_chip* chip, 
 								u8 __user *buffer,
 								u32 buffer_len);
@@ -32,6 +32,8 @@
 #include <linux/slab.h>
 #include <linux/module.h>
 #include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/delay.h>
 #include <asm/uaccess.h>
 #include <linux/netlink.h>
 #include <net/sock.h>
@@ -67,8 +69,10 @@ module_param_array(id, charp, NULL, 0444);
 MODULE_PARM_DESC(id, "ID string for the Hercules DJ Series adapter.");
 
 /* static DECLARE_MUTEX(register_mutex); */
+/* serializes changes to usb_chip, which are made on probe and on the last dec_chip_ref_count() */
 static DEFINE_SEMAPHORE(register_mutex);
 
+/* read under RCU by inc_chip_ref_count(), so that lookups do not take register_mutex */
 static struct snd_hdj_chip *usb_chip[SNDRV_CARDS];
 
 /* reference count for the socket */
@@ -222,6 +226,112 @@ static int midimp3_intf_num_full_controller_num_check(struct snd_hdj_chip *chip,
 	return 0;
 }
 
+/* ALERT: the bucket's lock needs to be acquired before calling */
+static void output_bucket_refill(struct hdj_output_bucket *bucket)
+{
+	u64 now = hdj_ktime_get_ns();
+	s64 max_credit = (s64)bucket->burst*bucket->interval_ns;
+
+	bucket->credit_ns += now - bucket->last_ns;
+	bucket->last_ns = now;
+	if (bucket->credit_ns > max_credit) {
+		bucket->credit_ns = max_credit;
+	}
+}
+
+void hdj_output_bucket_set_rate(struct hdj_output_bucket *bucket, u32 rate, u32 burst)
+{
+	unsigned long flags;
+
+	if (burst < 1) {
+		burst = 1;
+	} else if (burst > HDJ_OUTPUT_BURST_MAX) {
+		burst = HDJ_OUTPUT_BURST_MAX;
+	}
+	if (rate > NSEC_PER_SEC) {
+		rate = NSEC_PER_SEC;
+	}
+
+	spin_lock_irqsave(&bucket->lock, flags);
+	bucket->rate = rate;
+	bucket->burst = burst;
+	bucket->interval_ns = rate!=0 ? NSEC_PER_SEC/rate : 0;
+	/* start out full */
+	bucket->credit_ns = (s64)burst*bucket->interval_ns;
+	bucket->last_ns = hdj_ktime_get_ns();
+	spin_unlock_irqrestore(&bucket->lock, flags);
+}
+
+void hdj_output_bucket_get_rate(struct hdj_output_bucket *bucket, u32 *rate, u32 *burst)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&bucket->lock, flags);
+	*rate = bucket->rate;
+	*burst = bucket->burst;
+	spin_unlock_irqrestore(&bucket->lock, flags);
+}
+
+u64 hdj_output_bucket_try_take(struct hdj_output_bucket *bucket)
+{
+	unsigned long flags;
+	u64 wait = 0;
+
+	spin_lock_irqsave(&bucket->lock, flags);
+	if (bucket->interval_ns!=0) {
+		output_bucket_refill(bucket);
+		if (bucket->credit_ns >= bucket->interval_ns) {
+			bucket->credit_ns -= bucket->interval_ns;
+		} else {
+			wait = bucket->interval_ns - bucket->credit_ns;
+		}
+	}
+	spin_unlock_irqrestore(&bucket->lock, flags);
+	return wait;
+}
+
+u64 hdj_output_bucket_wait_ns(struct hdj_output_bucket *bucket)
+{
+	unsigned long flags;
+	u64 wait = 0;
+
+	spin_lock_irqsave(&bucket->lock, flags);
+	if (bucket->interval_ns!=0) {
+		output_bucket_refill(bucket);
+		if (bucket->credit_ns < bucket->interval_ns) {
+			wait = bucket->interval_ns - bucket->credit_ns;
+		}
+	}
+	spin_unlock_irqrestore(&bucket->lock, flags);
+	return wait;
+}
+
+void hdj_output_bucket_take(struct hdj_output_bucket *bucket)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&bucket->lock, flags);
+	if (bucket->interval_ns!=0) {
+		output_bucket_refill(bucket);
+		bucket->credit_ns -= bucket->interval_ns;
+	}
+	spin_unlock_irqrestore(&bucket->lock, flags);
+}
+
+void hdj_output_bucket_sleep(struct hdj_output_bucket *bucket)
+{
+	u64 wait;
+
+	while ((wait = hdj_output_bucket_try_take(bucket))!=0) {
+		/* a wait never exceeds a few intervals, which are at most a second */
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36) )
+		usleep_range((u32)wait/NSEC_PER_USEC, (u32)wait/NSEC_PER_USEC + 100);
+#else
+		msleep(DIV_ROUND_UP((u32)wait, NSEC_PER_MSEC));
+#endif
+	}
+}
+
 static void proc_fw_version_read(struct snd_info_entry *entry, 
 									struct snd_info_buffer *buffer)
 {
@@ -329,6 +439,137 @@ static void proc_product_code_read(struct snd_info_entry *entry,
 	}
 }
 
+static void proc_input_urb_count_write(struct snd_info_entry *entry,
+                                      struct snd_info_buffer *buffer)
+{
+	struct snd_hdj_chip *chip;
+	struct usb_hdjbulk* ubulk;
+	char line[64];
+	int count;
+	int rc, num;
+	int chip_index = (int)(unsigned long)entry->private_data;
+	
+	chip = inc_chip_ref_count(chip_index);
+	if (chip!=NULL) {
+		ubulk = bulk_from_chip(chip);
+		if (ubulk!=NULL) {
+			while (!snd_info_get_line(buffer, line, sizeof(line))) {
+				if ((num=sscanf(line, "%d", &count)) != 1) {
+					break;	
+				}
+				if ((rc=set_continuous_reader_urb_count(ubulk, count))!=0) {
+					printk(KERN_WARNING"%s() set_continuous_reader_urb_count failed, rc:%d\n",
+							__FUNCTION__,rc);
+				}
+				break;
+			}
+		}
+		dec_chip_ref_count(chip_index);
+	}
+}
+
+static void proc_input_urb_count_read(struct snd_info_entry *entry, 
+									struct snd_info_buffer *buffer)
+{
+	struct snd_hdj_chip *chip;
+	struct usb_hdjbulk* ubulk;
+	int chip_index = (int)(unsigned long)entry->private_data;
+	int count;
+	
+	chip = inc_chip_ref_count(chip_index);
+	if (chip!=NULL) {
+		ubulk = bulk_from_chip(chip);
+		if (ubulk!=NULL) {
+			if ((count = get_continuous_reader_urb_count(ubulk)) >= 0) {
+				snd_iprintf(buffer, "%d\n",count);
+			}
+		}
+		dec_chip_ref_count(chip_index);
+	}
+}
+
+static void proc_input_stats_read(struct snd_info_entry *entry, 
+									struct snd_info_buffer *buffer)
+{
+	struct snd_hdj_chip *chip;
+	struct usb_hdjbulk* ubulk;
+	int chip_index = (int)(unsigned long)entry->private_data;
+	struct dj_reader_stats stats;
+	u32 num_readers;
+	
+	chip = inc_chip_ref_count(chip_index);
+	if (chip!=NULL) {
+		ubulk = bulk_from_chip(chip);
+		if (ubulk!=NULL && get_input_stats_totals(ubulk, &stats, &num_readers)==0) {
+			snd_iprintf(buffer, "readers: %u\n",num_readers);
+			snd_iprintf(buffer, "queued: %llu\n",(unsigned long long)stats.queued);
+			snd_iprintf(buffer, "delivered: %llu\n",(unsigned long long)stats.delivered);
+			snd_iprintf(buffer, "dropped: %llu\n",(unsigned long long)stats.dropped);
+			snd_iprintf(buffer, "max_depth: %u\n",stats.max_depth);
+			snd_iprintf(buffer, "urb_errors: %llu\n",(unsigned long long)stats.urb_errors);
+			snd_iprintf(buffer, "urb_sequence_gaps: %llu\n",
+						(unsigned long long)stats.urb_sequence_gaps);
+			snd_iprintf(buffer, "device_sequence_gaps: %llu\n",
+						(unsigned long long)stats.device_sequence_gaps);
+		}
+		dec_chip_ref_count(chip_index);
+	}
+}
+
+static void proc_output_rate_write(struct snd_info_entry *entry,
+                                      struct snd_info_buffer *buffer)
+{
+	struct snd_hdj_chip *chip;
+	char line[64];
+	u32 rate, burst;
+	int num;
+	int chip_index = (int)(unsigned long)entry->private_data;
+	
+	chip = inc_chip_ref_count(chip_index);
+	if (chip!=NULL) {
+		while (!snd_info_get_line(buffer, line, sizeof(line))) {
+			/* "rate [burst]", in transfers per second, with a rate of 0 for no limit */
+			if ((num=sscanf(line, "%u %u", &rate, &burst)) < 1) {
+				break;	
+			}
+			if (num < 2) {
+				burst = 1;
+			}
+			/* HID output reports need their gap after every report, so these devices can 
+			 *  only be slowed down, and take no bursts */
+			if (chip->product_code==DJCONTROLLER_PRODUCT_CODE) {
+				if (rate==0 || rate > HDJ_OUTPUT_RATE_MP3) {
+					rate = HDJ_OUTPUT_RATE_MP3;
+				}
+				burst = 1;
+			} else if (chip->product_code!=DJCONTROLSTEEL_PRODUCT_CODE) {
+				if (rate==0 || rate > HDJ_OUTPUT_RATE_HID) {
+					rate = HDJ_OUTPUT_RATE_HID;
+				}
+				burst = 1;
+			}
+			hdj_output_bucket_set_rate(&chip->output_bucket, rate, burst);
+			break;
+		}
+		dec_chip_ref_count(chip_index);
+	}
+}
+
+static void proc_output_rate_read(struct snd_info_entry *entry, 
+									struct snd_info_buffer *buffer)
+{
+	struct snd_hdj_chip *chip;
+	int chip_index = (int)(unsigned long)entry->private_data;
+	u32 rate, burst;
+	
+	chip = inc_chip_ref_count(chip_index);
+	if (chip!=NULL) {
+		hdj_output_bucket_get_rate(&chip->output_bucket, &rate, &burst);
+		snd_iprintf(buffer, "%u %u\n",rate,burst);
+		dec_chip_ref_count(chip_index);
+	}
+}
+
 static void proc_jog_lock_write(struct snd_info_entry *entry,
                                       struct snd_info_buffer *buffer)
 {
@@ -1181,6 +1422,28 @@ static void snd_hdj_chip_create_proc(struct snd_hdj_chip *chip)
 		entry->c.text.write = proc_fx_state_write;
         entry->mode |= S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
 	}
+	if (is_continuous_reader_supported(chip)==1 &&
+		snd_card_proc_new(chip->card, "input_urb_count", &entry)==0) {
+		snd_info_set_text_ops(entry, 
+						(void*)(unsigned long)chip->index, 
+						proc_input_urb_count_read);
+		entry->c.text.write = proc_input_urb_count_write;
+        entry->mode |= S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+	}
+	if (is_continuous_reader_supported(chip)==1 &&
+		snd_card_proc_new(chip->card, "input_stats", &entry)==0) {
+		snd_info_set_text_ops(entry, 
+						(void*)(unsigned long)chip->index, 
+						proc_input_stats_read);
+		entry->mode |= S_IRUSR | S_IRGRP | S_IROTH;
+	}
+	if (! snd_card_proc_new(chip->card, "output_rate", &entry)) {
+		snd_info_set_text_ops(entry, 
+						(void*)(unsigned long)chip->index, 
+						proc_output_rate_read);
+		entry->c.text.write = proc_output_rate_write;
+        entry->mode |= S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+	}
 #else
 	if (! snd_card_proc_new(chip->card, "usbbus", &entry))
 		snd_info_set_text_ops(entry, (void*)(unsigned long)chip->index, 1024, proc_chip_usbbus_read);
@@ -1344,6 +1607,31 @@ static void snd_hdj_chip_create_proc(struct snd_hdj_chip *chip)
 		entry->c.text.write = proc_fx_state_write;
         entry->mode |= S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
 	}
+	if (is_continuous_reader_supported(chip)==1 &&
+		snd_card_proc_new(chip->card, "input_urb_count", &entry)==0) {
+		snd_info_set_text_ops(entry, 
+						(void*)(unsigned long)chip->index, 
+						1024,
+						proc_input_urb_count_read);
+		entry->c.text.write = proc_input_urb_count_write;
+        entry->mode |= S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+	}
+	if (is_continuous_reader_supported(chip)==1 &&
+		snd_card_proc_new(chip->card, "input_stats", &entry)==0) {
+		snd_info_set_text_ops(entry, 
+						(void*)(unsigned long)chip->index, 
+						1024,
+						proc_input_stats_read);
+		entry->mode |= S_IRUSR | S_IRGRP | S_IROTH;
+	}
+	if (! snd_card_proc_new(chip->card, "output_rate", &entry)) {
+		snd_info_set_text_ops(entry, 
+						(void*)(unsigned long)chip->index, 
+						1024,
+						proc_output_rate_read);
+		entry->c.text.write = proc_output_rate_write;
+        entry->mode |= S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+	}
 #endif
 }
 
@@ -1559,6 +1847,8 @@ static int snd_hdj_chip_free(struct snd_hdj_chip *chip)
 
 	hdj_kill_chip_urbs(chip);
 
+	free_output_shadow(chip);
+
 	if(chip->ctrl_req_buffer != NULL)
 	{
 		usb_free_coherent(chip->dev,
@@ -1687,7 +1977,7 @@ static int snd_hdj_chip_create(struct usb_device *dev,
 	
 	memset(chip,0,sizeof(*chip));
 	chip->index = idx;
-	chip->ref_count = 0;
+	atomic_set(&chip->ref_count, 0);
 	chip->dev = dev;
 	chip->card = card;
 	chip->product_code = product_code;
@@ -1711,6 +2001,17 @@ static int snd_hdj_chip_create(struct usb_device *dev,
 	/* init_MUTEX(&chip->netlink_list_mutex); */
     sema_init(&chip->vendor_request_mutex, 1);
 	INIT_LIST_HEAD(&chip->netlink_registered_processes);
+	sema_init(&chip->output_shadow_mutex, 1);
+
+	/* pace output at what the device can take */
+	spin_lock_init(&chip->output_bucket.lock);
+	if (product_code==DJCONTROLLER_PRODUCT_CODE) {
+		hdj_output_bucket_set_rate(&chip->output_bucket, HDJ_OUTPUT_RATE_MP3, 1);
+	} else if (product_code==DJCONTROLSTEEL_PRODUCT_CODE) {
+		hdj_output_bucket_set_rate(&chip->output_bucket, HDJ_OUTPUT_RATE_STEEL, 1);
+	} else {
+		hdj_output_bucket_set_rate(&chip->output_bucket, HDJ_OUTPUT_RATE_HID, 1);
+	}
 	
 	/* fill in DJ capabilities for this device */
 	snd_hdj_enter_caps(chip);
@@ -1904,7 +2205,9 @@ static int hdj_probe(struct usb_interface *interface, const struct usb_device_id
 	down(&register_mutex);
 	for (i = 0; i < SNDRV_CARDS; i++) {
 		if (usb_chip[i]!=NULL && usb_chip[i]->dev == usb_dev) {
-			if (atomic_read(&usb_chip[i]->shutdown)) {
+			/* each supported interface must increment the chip reference count */
+			if (atomic_read(&usb_chip[i]->shutdown) || 
+			    !atomic_inc_not_zero(&usb_chip[i]->ref_count)) {
 				snd_printk(KERN_WARNING"hdj_probe(): USB device is in the shutdown state, cannot create a card instance\n");
 				up(&register_mutex);
 				goto __error_no_dec;
@@ -1954,16 +2257,16 @@ static int hdj_probe(struct usb_interface *interface, const struct usb_device_id
 			/* for the goto __error path */
 			card = chip->card;
 		}
+
+		/* the reference of this interface, taken before lookups can see the chip */
+		atomic_set(&chip->ref_count, 1);
+		rcu_assign_pointer(usb_chip[chip->index], chip);
 	}
-	usb_chip[chip->index] = chip;
 	atomic_inc(&chip->num_interfaces);
 	usb_set_intfdata(interface, (void *)(unsigned long)chip->index);
 	card = chip->card;
 	up(&register_mutex);
 
-	/* each supported interface must increment the chip reference count */
-	inc_chip_ref_count(chip->index);
-
 	if (snd_hdj_create_streams(chip, ifnum) < 0) {
 		snd_printk(KERN_WARNING"hdj_probe(): snd_usb_create_streams() failed\n");
 		goto __error;
@@ -2002,17 +2305,27 @@ struct snd_hdj_chip* inc_chip_ref_count(int chip_index)
 		return NULL;
 	}
 
-	down(&register_mutex);
-	if(usb_chip[chip_index] != NULL && atomic_read(&usb_chip[chip_index]->shutdown)!=1) {
-		chip = usb_chip[chip_index];
-		++(chip->ref_count);
+	/* Lockless- the chip's memory outlives the RCU read side, and a count which has dropped to 0
+	 *  is never raised again, so a chip which is being torn down cannot be acquired */
+	rcu_read_lock();
+	chip = rcu_dereference(usb_chip[chip_index]);
+	if (chip != NULL && 
+	    (atomic_read(&chip->shutdown)==1 || !atomic_inc_not_zero(&chip->ref_count))) {
+		chip = NULL;
 	}
-	
-	up(&register_mutex);
+	rcu_read_unlock();
 
 	return chip;
 }
 
+/* Takes another reference on a chip which the caller already holds a reference on, so unlike
+ *  inc_chip_ref_count() it succeeds after the device has gone away.  It is dropped with
+ *  dec_chip_ref_count(). */
+void hold_chip_ref_count(struct snd_hdj_chip* chip)
+{
+	atomic_inc(&chip->ref_count);
+}
+
 struct snd_hdj_chip* dec_chip_ref_count(int chip_index)
 {
 	struct snd_hdj_chip* chip = NULL;
@@ -2028,57 +2341,63 @@ struct snd_hdj_chip* dec_chip_ref_count(int chip_index)
 		/*invalid index*/
 		return NULL;
 	}
+	/* the caller holds a reference, so the chip cannot be removed under us */
+	rcu_read_lock();
+	chip = rcu_dereference(usb_chip[chip_index]);
+	rcu_read_unlock();
+	if (chip == NULL) {
+		return NULL;
+	}
+	if (!atomic_dec_and_test(&chip->ref_count)) {
+		return chip;
+	}
+
+	/* this was the last reference, so tear the chip down */
 	down(&register_mutex);
-	if(usb_chip[chip_index] != NULL) {
-		chip = usb_chip[chip_index];
-		--(chip->ref_count);
-		
-		if(chip->ref_count <= 0) {
-			card = chip->card;
-			/* remove the chip from the list here- no one else can now access it 
-			 *   except this routine and the chip destructor, associated with the card's
-			 *   "low level device" */
-			usb_chip[chip_index] = NULL; 
-			atomic_set(&chip->shutdown, 1);
-			
-			/* we have no callback associated with disconnect */
-			snd_card_disconnect(card);
+	card = chip->card;
+	/* remove the chip from the list here- no one else can now access it 
+	 *   except this routine and the chip destructor, associated with the card's
+	 *   "low level device" */
+	rcu_assign_pointer(usb_chip[chip_index], NULL);
+	atomic_set(&chip->shutdown, 1);
 
-			/* release the midi resources */
-			if (!list_empty(&chip->midi_list)) {
-				list_for_each_safe(p,next,&chip->midi_list) {
-					snd_hdjmidi_disconnect(p);
-				}
-			}
+	/* lookups which found the chip before it was removed must be done with it
+	 *  before it may be freed */
+	synchronize_rcu();
+	
+	/* we have no callback associated with disconnect */
+	snd_card_disconnect(card);
 
-			/* release the bulk resources */
-			if (!list_empty(&chip->bulk_list)) {
-				list_for_each_safe(p,next,&chip->bulk_list) {
-					hdjbulk_disconnect(p);
-				}
-			}
-			
-			/* Free all remaining registered processes- no one is allowed to register
-			 *   anymore, because the chip is being destroyed and cannot be reacquired */
-			uninit_netlink_state(chip);
+	/* release the midi resources */
+	if (!list_empty(&chip->midi_list)) {
+		list_for_each_safe(p,next,&chip->midi_list) {
+			snd_hdjmidi_disconnect(p);
+		}
+	}
 
-			/* Freeing the card results in the chip cleanup routine (called the
-			 *  chip's destructor) being executed, but only when no client has
-			 *  the MIDI device open through ALSA */
-#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19) )
-			snd_card_free_when_closed(card);
-#else
-			snd_card_free(card);
-#endif
-			up(&register_mutex);
-			
-			/* the chip has been destroyed */
-			return NULL; 
+	/* release the bulk resources */
+	if (!list_empty(&chip->bulk_list)) {
+		list_for_each_safe(p,next,&chip->bulk_list) {
+			hdjbulk_disconnect(p);
 		}
 	}
+	
+	/* Free all remaining registered processes- no one is allowed to register
+	 *   anymore, because the chip is being destroyed and cannot be reacquired */
+	uninit_netlink_state(chip);
 
+	/* Freeing the card results in the chip cleanup routine (called the
+	 *  chip's destructor) being executed, but only when no client has
+	 *  the MIDI device open through ALSA */
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19) )
+	snd_card_free_when_closed(card);
+#else
+	snd_card_free(card);
+#endif
 	up(&register_mutex);
-	return chip;
+	
+	/* the chip has been destroyed */
+	return NULL;
 }
 
 /* since we could be "alive" for a bit of time after disconnect if a usermode
@@ -2172,6 +2491,9 @@ static void hdj_disconnect(struct usb_interface *interface)
 					spin_lock_irqsave(&ubulk->read_list_lock, flags);			
 					signal_all_waiting_readers(&ubulk->open_list);
 					spin_unlock_irqrestore(&ubulk->read_list_lock, flags);
+
+					/* and let poll()/epoll() clients know that the device is gone */
+					hdj_wake_up_poll(&ubulk->read_poll_wait, HDJ_POLL_HANGUP_MASK);
 				}
 			}
 		}
@@ -62,6 +62,25 @@ struct netlink_list{
 
 /* forward declaration */
 struct snd_hdj_caps;
+struct hdj_output_shadow;
+
+/* Token bucket which paces the output transfers of a device: MIDI render of HID only 
+ *  controllers, HID output reports and Steel LED bulk writes.  Each transfer costs one token,
+ *  tokens are added at rate per second, and at most burst of them accumulate. */
+struct hdj_output_bucket {
+	spinlock_t	lock;
+	u32		rate;	/* 0 for no limit */
+	u32		burst;
+	u32		interval_ns;	/* time to earn one token */
+	s64		credit_ns;	/* earned time, at most burst intervals */
+	u64		last_ns;	/* when credit_ns was last refilled */
+};
+
+/* default output rates, in transfers per second */
+#define HDJ_OUTPUT_RATE_MP3		125	/* HID, 8ms interrupt period */
+#define HDJ_OUTPUT_RATE_HID		100	/* these need a gap of 10ms between HID output reports */
+#define HDJ_OUTPUT_RATE_STEEL	0	/* bulk, the device flow controls us */
+#define HDJ_OUTPUT_BURST_MAX	32	/* Steel only, HID devices are held to a burst of 1 */
 
 /* Context for card instance */
 struct snd_hdj_chip {
@@ -115,8 +134,17 @@ struct snd_hdj_chip {
 	struct list_head	netlink_registered_processes;
 	struct semaphore	netlink_list_mutex;
 
-	/* chip reference count- accessed by inc_chip_ref_count() and dec_chip_ref_count() */
-	int ref_count;
+	/* shared output control page, allocated on the first mmap- see configuration_manager.c */
+	struct semaphore	output_shadow_mutex;
+	struct hdj_output_shadow *output_shadow;
+
+	/* paces output transfers, tunable through the output_rate proc entry */
+	struct hdj_output_bucket output_bucket;
+
+	/* chip reference count- accessed by inc_chip_ref_count() and dec_chip_ref_count().  It
+	 *  follows the kref rules: once it drops to 0 it is never raised again, and the chip is
+	 *  torn down. */
+	atomic_t ref_count;
 };
 
 /* Get a minor range for your devices from the usb maintainer */
@@ -201,6 +229,19 @@ struct snd_hdj_chip {
 void write_to_file(const char* fmt, ...); */
 struct snd_hdj_chip* inc_chip_ref_count(int chip_index);
 struct snd_hdj_chip* dec_chip_ref_count(int chip_index);
+void hold_chip_ref_count(struct snd_hdj_chip* chip);
+
+/* output pacing, see struct hdj_output_bucket */
+void hdj_output_bucket_set_rate(struct hdj_output_bucket *bucket, u32 rate, u32 burst);
+void hdj_output_bucket_get_rate(struct hdj_output_bucket *bucket, u32 *rate, u32 *burst);
+/* returns 0 and takes a token if one is available, or else the nanoseconds until one is */
+u64 hdj_output_bucket_try_take(struct hdj_output_bucket *bucket);
+/* returns the nanoseconds until a token is available, without taking it */
+u64 hdj_output_bucket_wait_ns(struct hdj_output_bucket *bucket);
+/* takes a token, even if none is available, which delays the following transfers */
+void hdj_output_bucket_take(struct hdj_output_bucket *bucket);
+/* sleeps until a token is available, and takes it */
+void hdj_output_bucket_sleep(struct hdj_output_bucket *bucket);
 
 /* since we could be "alive" for a bit of time after disconnect if a usermode
  *  client maintains a handle, we reference interface and devices */
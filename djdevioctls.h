@@ -381,6 +381,169 @@ struct FIRMWARE_FILE
 #define STEEL_DEFAULT_SERIAL_NUMBER				0x30303030
 #define RMX_DEFAULT_SERIAL_NUMBER				0
 
+/*
+ * Shared input report ring, mapped with mmap on the bulk device (offset 0, size returned
+ *  by DJ_IOCTL_GET_INPUT_RING_SIZE).  The header is followed, at header_size bytes from the
+ *  start of the mapping, by num_reports slots of report_size bytes, each holding one input
+ *  report of packet_size valid bytes (the same data which read returns).
+ * The driver writes report n in slot (n % num_reports), and only then sets head to n+1.  
+ *  Clients keep their own position: after reading head, a read barrier is required before
+ *  copying slots, and if head has advanced by more than num_reports once the copy is done,
+ *  the copied reports were overwritten.  A client may store its position in tail, in which 
+ *  case poll signals readability while tail differs from head, and the driver counts reports
+ *  written over unread slots in overruns.  All other fields are read only.
+ * Only one file descriptor at a time may map the ring, as it has one tail; mmap fails with 
+ *  -EBUSY on any other while mappings of the first remain.  Once a file descriptor has 
+ *  mapped the ring, reports are no longer queued for its read, which fails with -EBUSY, and 
+ *  its poll only reflects the ring.  Mapping the ring sets tail to head.
+ */
+#define DJ_INPUT_RING_VERSION				1
+#define DJ_INPUT_RING_NUM_REPORTS			256
+#define DJ_INPUT_RING_REPORT_SIZE			64
+struct dj_input_ring_header {
+	__u32 version;
+	__u32 header_size;
+	__u32 num_reports;
+	__u32 report_size;
+	__u32 packet_size;
+	__u32 head; /* written by the driver */
+	__u32 tail; /* written by the client */
+	__u32 overruns; /* written by the driver */
+	__u32 reserved[8];
+};
+
+/*
+ * Flags for DJ_IOCTL_SET_READ_FLAGS, which select the format returned by read on the bulk 
+ *  device.  By default each read returns exactly one input report.
+ * DJ_READ_FLAG_BATCH: each read returns as many queued reports as fit in the buffer (at 
+ *  least one, blocking as usual if none are queued).
+ * DJ_READ_FLAG_BATCH_HEADER: the reports are preceded by a struct dj_read_batch_header.  It
+ *  requires DJ_READ_FLAG_BATCH.
+ * DJ_READ_FLAG_TIMESTAMP: each report is preceded by a struct dj_read_timestamp_header.  In
+ *  batch mode the count and packet_size of the batch header still refer to the reports alone.
+ * DJ_READ_FLAG_CHANGES_ONLY: reports which are identical to the previous one are not queued,
+ *  except for the first one, for keyframes, see DJ_IOCTL_SET_KEYFRAME_INTERVAL, and for those
+ *  in which a relative control such as a jog wheel moved.
+ * DJ_READ_FLAG_LATEST: nothing is queued, read returns the newest report received from the 
+ *  device, and only blocks if it was already returned to this reader.  Only 
+ *  DJ_READ_FLAG_TIMESTAMP can be combined with it.
+ * DJ_READ_FLAG_EVENTS: read returns the controls which changed, as struct dj_control_event, 
+ *  rather than reports.  Each read returns as many queued events as fit in the buffer (at 
+ *  least one).  No other flag can be combined with it.
+ */
+#define DJ_READ_FLAG_BATCH					0x00000001
+#define DJ_READ_FLAG_BATCH_HEADER			0x00000002
+#define DJ_READ_FLAG_TIMESTAMP				0x00000004
+#define DJ_READ_FLAG_CHANGES_ONLY			0x00000008
+#define DJ_READ_FLAG_LATEST					0x00000010
+#define DJ_READ_FLAG_EVENTS					0x00000020
+#define DJ_READ_FLAGS_ALL					(DJ_READ_FLAG_BATCH | DJ_READ_FLAG_BATCH_HEADER | \
+											 DJ_READ_FLAG_TIMESTAMP | DJ_READ_FLAG_CHANGES_ONLY | \
+											 DJ_READ_FLAG_LATEST | DJ_READ_FLAG_EVENTS)
+
+struct dj_read_batch_header {
+	__u32 count; /* number of reports which follow */
+	__u32 packet_size; /* size of each report */
+};
+
+/* 
+ * Returned by DJ_IOCTL_GET_READER_STATS.  The reader counters belong to the queue which read 
+ *  uses for the calling thread, the device totals are shared by all clients.
+ */
+struct dj_reader_stats {
+	__u64 queued; /* reports queued for this reader */
+	__u64 delivered; /* reports returned by read */
+	__u64 dropped; /* oldest reports discarded because the queue was full */
+	__u32 max_depth; /* high-water mark of the queue */
+	__u32 queue_size; /* capacity of the queue */
+	__u64 urb_errors; /* input URBs which completed with an error */
+	__u64 urb_sequence_gaps; /* input URBs which completed out of sequence */
+	__u64 device_sequence_gaps; /* DJ Control Steel only, gaps in the device sequence byte */
+};
+
+/* dj_read_timestamp_header flags */
+#define DJ_TIMESTAMP_HAS_DEVICE_SEQ			0x01 /* device_sequence_number is valid */
+
+struct dj_read_timestamp_header {
+	__u64 timestamp_ns; /* CLOCK_MONOTONIC time at which the report's URB completed */
+	__u32 urb_sequence_number; /* sequence number of the URB which carried the report */
+	__u8  device_sequence_number; /* DJ Control Steel only, byte DJ_STEEL_EP_81_SEQ_NUM */
+	__u8  flags; /* DJ_TIMESTAMP_* */
+	__u16 reserved;
+};
+
+/* 
+ * Passed to DJ_IOCTL_SET_OUTPUT_CONTROL_VECTOR, followed by count entries.  Each entry is a
+ *  struct dj_output_control_entry, followed by the data and then the mask, each of the size 
+ *  returned by DJ_IOCTL_GET_CONTROL_DATA_OUTPUT_PACKET_SIZE, as for 
+ *  DJ_IOCTL_SET_OUTPUT_CONTROL_DATA.  Entries are packed, without padding.
+ */
+#define DJ_OUTPUT_CONTROL_VECTOR_MAX		64
+
+struct dj_output_control_vector {
+	__u32 count; /* number of entries, at most DJ_OUTPUT_CONTROL_VECTOR_MAX */
+	__u32 reserved;
+};
+
+struct dj_output_control_entry {
+	/* CLOCK_MONOTONIC time after which the entry is stale and is skipped, 0 for none */
+	__u64 deadline_ns;
+};
+
+/*
+ * Shared output control page, mapped with mmap on the bulk device (or, for the DJ Control MP3, 
+ *  on its hdjbulk device) at offset DJ_OUTPUT_SHADOW_MMAP_OFFSET, with the size returned by 
+ *  DJ_IOCTL_GET_OUTPUT_SHADOW_SIZE.  The header is followed, at header_size bytes from the 
+ *  start of the mapping, by control_size bytes of data and then control_size bytes of mask, in 
+ *  the format of DJ_IOCTL_SET_OUTPUT_CONTROL_DATA.  Both start zeroed.
+ * A client updates LEDs with plain stores to data and mask, followed by a write barrier and an 
+ *  increment of generation.  While the page is mapped, the driver checks generation every 
+ *  flush_interval_us (see the output_shadow_flush_hz module parameter) and, if it changed, 
+ *  applies the masked data to its cached control data buffer and sends it, as the IOCTL would, 
+ *  and then sets flushed_generation.  Stores made while a flush is in progress go out with the 
+ *  next one, as long as generation is incremented after them.  All other fields are read only.
+ */
+#define DJ_OUTPUT_SHADOW_VERSION			1
+#define DJ_OUTPUT_SHADOW_MMAP_OFFSET		0x100000
+struct dj_output_shadow_header {
+	__u32 version;
+	__u32 header_size;
+	__u32 control_size;
+	__u32 generation; /* written by the client */
+	__u32 flushed_generation; /* written by the driver */
+	__u32 flush_interval_us; /* written by the driver */
+	__u32 reserved[10];
+};
+
+/* dj_control_event types */
+#define DJ_CONTROL_TYPE_BYTE				0 /* a byte of the input report */
+#define DJ_CONTROL_TYPE_STATE				1 /* a device state byte, ex: FX or mode shift state */
+#define DJ_CONTROL_TYPE_BUTTON				2 /* value is 1 when pressed, 0 when released */
+#define DJ_CONTROL_TYPE_ABSOLUTE			3 /* a fader or knob, value is its position */
+#define DJ_CONTROL_TYPE_RELATIVE			4 /* a jog wheel, value is the signed movement */
+#define DJ_CONTROL_TYPE_FLAG				5 /* a device state bit, value is 1 when set */
+
+/* control_id of the control at bit_number of byte_number, 0 for controls of whole bytes */
+#define DJ_CONTROL_ID(byte_number,bit_number)	((byte_number)*8 + (bit_number))
+
+/* 
+ * Returned by read with DJ_READ_FLAG_EVENTS.  The report is decoded once, on completion, 
+ *  against the product's control table, and control_id is DJ_CONTROL_ID() of the control's 
+ *  place in the input report.  The DJ Console and Rmx report buttons in bytes 1 to 4, knobs
+ *  and faders in bytes 5 to 13, pitch and jog wheels in bytes 14 to 17 and the mouse in bytes
+ *  18 and 19.  The Mk2 is alike, except that byte 5 holds the headphone monitor buttons (deck
+ *  A, deck B, split, mix) in bits 0 to 3.  The DJ Control Steel reports its FX and mode shift
+ *  state as flags, and its other bytes as DJ_CONTROL_TYPE_BYTE.  Relative controls send an 
+ *  event for every report in which they moved.
+ */
+struct dj_control_event {
+	__u64 timestamp_ns; /* CLOCK_MONOTONIC time at which the report's URB completed */
+	__u16 control_id;
+	__u8  type; /* DJ_CONTROL_TYPE_* */
+	__u8  reserved;
+	__u32 value; /* new value of the control */
+};
+
 /* product codes */
 #define DJCONSOLE_PRODUCT_UNKNOWN				0
 #define DJCONSOLE_PRODUCT_CODE					1
@@ -701,6 +864,11 @@ struct FIRMWARE_FILE
  *				a bitmask, indicating which bits will be set in the driver's own cached buffer 
  *				before sending.  The driver's cached control data buffer may be queried via 
  *				DJ_IOCTL_GET_OUTPUT_CONTROL_DATA.
+ * Except for the DJ Control MP3, the IOCTL returns once the cached buffer is updated, and the 
+ *  driver sends it shortly after.  Updates which are made in the meantime are sent together.
+ *  A transfer which fails is retried a few times, and then kept for the next update or for
+ *  resume.  The next call then applies its update, and returns the error of the failed 
+ *  transfer.
  */
 #define DJ_IOCTL_SET_OUTPUT_CONTROL_DATA			_IOW (MAJOR_NUM, 43, char*)
 #ifdef CONFIG_COMPAT
@@ -732,6 +900,81 @@ struct FIRMWARE_FILE
  */
 #define DJ_IOCTL_GET_DEVICE_CAPS					_IOR (MAJOR_NUM, 46, struct snd_hdj_caps*)
 
+/* DJ_IOCTL_GET_INPUT_RING_SIZE
+ * Returns the size to pass to mmap in order to map the shared input report ring, which is
+ *  described by struct dj_input_ring_header.
+ * IOCTL required buffer size: __u32.
+ */
+#define DJ_IOCTL_GET_INPUT_RING_SIZE				_IOR (MAJOR_NUM, 47, __u32)
+
+/* DJ_IOCTL_SET_READ_FLAGS
+ * Selects the format of the data returned by read for this file descriptor, see 
+ *  DJ_READ_FLAG_BATCH and related flags.  Combinations of flags which are not supported
+ *  fail with -EINVAL.
+ * IOCTL required buffer size: __u32.
+ */
+#define DJ_IOCTL_SET_READ_FLAGS					_IOW (MAJOR_NUM, 48, __u32)
+
+/* DJ_IOCTL_GET_READ_FLAGS
+ * Returns the read flags of this file descriptor.
+ * IOCTL required buffer size: __u32.
+ */
+#define DJ_IOCTL_GET_READ_FLAGS					_IOR (MAJOR_NUM, 49, __u32)
+
+/* DJ_IOCTL_ADD_READ_CURSOR
+ * By default all threads reading a file descriptor share one queue of input reports.  This
+ *  gives the calling thread its own queue instead, which receives every report from now on,
+ *  independently of the other threads.  The queue lasts until the file descriptor is closed.
+ * IOCTL required buffer size: none.
+ */
+#define DJ_IOCTL_ADD_READ_CURSOR					_IO (MAJOR_NUM, 50)
+
+/* DJ_IOCTL_SET_INPUT_URB_COUNT
+ * Sets the number of input URBs which the driver keeps in flight for the device, from 2 to 32.
+ *  More URBs ride out longer completion latency, for example on a hub shared with an audio 
+ *  interface.  The setting applies to every client of the device.
+ * IOCTL required buffer size: __u32.
+ */
+#define DJ_IOCTL_SET_INPUT_URB_COUNT				_IOW (MAJOR_NUM, 51, __u32)
+
+/* DJ_IOCTL_GET_INPUT_URB_COUNT
+ * Returns the number of input URBs which the driver keeps in flight for the device.
+ * IOCTL required buffer size: __u32.
+ */
+#define DJ_IOCTL_GET_INPUT_URB_COUNT				_IOR (MAJOR_NUM, 52, __u32)
+
+/* DJ_IOCTL_SET_KEYFRAME_INTERVAL
+ * With DJ_READ_FLAG_CHANGES_ONLY, a report is still queued for this file descriptor if none 
+ *  was queued for this many milliseconds, even if it is unchanged.  0 (the default) disables 
+ *  keyframes.
+ * IOCTL required buffer size: __u32.
+ */
+#define DJ_IOCTL_SET_KEYFRAME_INTERVAL				_IOW (MAJOR_NUM, 53, __u32)
+
+/* DJ_IOCTL_GET_READER_STATS
+ * Returns the queue statistics of the calling thread's reader, and the input error totals of 
+ *  the device.
+ * IOCTL required buffer size: struct dj_reader_stats (same size for 32 or 64 bit)
+ */
+#define DJ_IOCTL_GET_READER_STATS					_IOR (MAJOR_NUM, 54, struct dj_reader_stats)
+
+/* DJ_IOCTL_SET_OUTPUT_CONTROL_VECTOR
+ * Applies several masked updates to the driver's cached control data buffer, in order, as 
+ *  DJ_IOCTL_SET_OUTPUT_CONTROL_DATA would, and then sends the buffer to the device once.
+ * IOCTL required buffer size: struct dj_output_control_vector followed by its entries.
+ */
+#define DJ_IOCTL_SET_OUTPUT_CONTROL_VECTOR			_IOW (MAJOR_NUM, 55, char*)
+#ifdef CONFIG_COMPAT
+#define DJ_IOCTL_SET_OUTPUT_CONTROL_VECTOR32		_IOW (MAJOR_NUM, 55, compat_long_t)
+#endif
+
+/* DJ_IOCTL_GET_OUTPUT_SHADOW_SIZE
+ * Returns the size to pass to mmap in order to map the shared output control page, which is
+ *  described by struct dj_output_shadow_header.
+ * IOCTL required buffer size: __u32.
+ */
+#define DJ_IOCTL_GET_OUTPUT_SHADOW_SIZE				_IOR (MAJOR_NUM, 56, __u32)
+
 #endif
 
 
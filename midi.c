@@ -34,6 +34,7 @@
 #include <linux/module.h>
 #include <linux/usb.h>
 #include <linux/kthread.h>
+#include <linux/hrtimer.h>
 #if ( LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35) )
 #include <linux/slab.h>
 #endif
@@ -66,6 +67,22 @@ struct midi_channel_elem channel_list[NUM_MIDI_CHANNELS];
 /* spinlock_t channel_list_lock = SPIN_LOCK_UNLOCKED; */
 DEFINE_SPINLOCK(channel_list_lock);
 
+/* indexed by MIDI byte, see MIDI_CLASS_* */
+const u16 snd_hdjmidi_byte_class[256] = {
+	[0x00 ... 0x7f] = MIDI_CLASS_DATA,
+	[0x80 ... 0xbf] = MIDI_CLASS_STATUS | MIDI_CLASS_CHANNEL | STATE_2PARAM_1,
+	[0xc0 ... 0xdf] = MIDI_CLASS_STATUS | MIDI_CLASS_CHANNEL | STATE_1PARAM,
+	[0xe0 ... 0xef] = MIDI_CLASS_STATUS | MIDI_CLASS_CHANNEL | STATE_2PARAM_1,
+	[0xf0] = MIDI_CLASS_STATUS | STATE_SYSEX_1,
+	[0xf1] = MIDI_CLASS_STATUS | STATE_1PARAM,
+	[0xf2] = MIDI_CLASS_STATUS | STATE_2PARAM_1,
+	[0xf3] = MIDI_CLASS_STATUS | STATE_1PARAM,
+	[0xf4 ... 0xf5] = STATE_UNKNOWN,
+	[0xf6] = MIDI_CLASS_SINGLE | STATE_UNKNOWN,
+	[0xf7] = MIDI_CLASS_SYSEX_END | STATE_UNKNOWN,
+	[0xf8 ... 0xff] = MIDI_CLASS_SINGLE | MIDI_CLASS_KEEP_STATE,
+};
+
 static struct usb_protocol_ops snd_hdjmidi_standard_ops = {
 	.input = snd_hdjmidi_standard_input,
 	.output = snd_hdjmidi_standard_output,
@@ -397,6 +414,7 @@ static int controller_input_init(struct controller_input_hid *controller_state,
 									struct snd_hdjmidi_in_endpoint* ep)
 {
 	int i;
+	unsigned int bytepos, n;
 
 	if (ep->umidi->chip->product_code==DJCONTROLLER_PRODUCT_CODE) {
 		ep->controller_state->is_weltrend = is_mp3_weltrend(ep->umidi->chip->usb_id);
@@ -451,7 +469,26 @@ static int controller_input_init(struct controller_input_hid *controller_state,
 				__cpu_to_be32(controller_state->control_details[i].midi_message_pressed);
 			controller_state->control_details[i].midi_message_released =
 				__cpu_to_be32(controller_state->control_details[i].midi_message_released);
+			if (controller_state->control_details[i].byte_number >= 
+				DJ_MP3_HID_INPUT_REPORT_LEN) {
+				snd_printk(KERN_WARNING"%s(): bad bytepos:%s, %d, ignoring control\n",
+					__FUNCTION__,
+					controller_state->control_details[i].name,
+					controller_state->control_details[i].byte_number);
+			}
 		}
+
+		/* index the controls by report byte */
+		n = 0;
+		for (bytepos = 0; bytepos < DJ_MP3_HID_INPUT_REPORT_LEN; bytepos++) {
+			controller_state->byte_controls_start[bytepos] = n;
+			for (i = 0; i < DJ_MP3_NUM_INPUT_CONTROLS; i++) {
+				if (controller_state->control_details[i].byte_number==bytepos) {
+					controller_state->byte_controls[n++] = i;
+				}
+			}
+		}
+		controller_state->byte_controls_start[DJ_MP3_HID_INPUT_REPORT_LEN] = n;
 	}
 	
 	return 0;
@@ -535,16 +572,19 @@ static int snd_hdjmidi_in_endpoint_create(struct snd_hdjmidi* umidi,
  */
 static void snd_hdjmidi_out_endpoint_delete(struct snd_hdjmidi_out_endpoint* ep)
 {
-#ifdef THROTTLE_MP3_RENDER
-	del_timer_sync(&ep->render_delay_timer);
-#endif
-	if (ep->urb) {
-		if (ep->urb->transfer_buffer) {
+	int i;
+
+	hrtimer_cancel(&ep->render_delay_timer);
+	for (i = 0; i < ep->num_urbs; ++i) {
+		if (ep->urbs[i]==NULL) {
+			continue;
+		}
+		if (ep->urbs[i]->transfer_buffer) {
 			usb_free_coherent(ep->umidi->chip->dev, ep->max_transfer,
-					ep->urb->transfer_buffer,
-					ep->urb->transfer_dma);
+					ep->urbs[i]->transfer_buffer,
+					ep->urbs[i]->transfer_dma);
 		}
-		usb_free_urb(ep->urb);
+		usb_free_urb(ep->urbs[i]);
 	}
 	if (ep->urb_led) {
 		if (ep->urb_led->transfer_buffer) {
@@ -615,6 +655,7 @@ static int controller_output_init(struct controller_output_hid *controller_state
 									struct snd_hdjmidi_out_endpoint* ep)
 {
 	int i;
+	u8 *message;
 	u16 max_transfer;
 	void* buffer;
 
@@ -665,6 +706,24 @@ static int controller_output_init(struct controller_output_hid *controller_state
 				__cpu_to_be32(controller_state->control_details[i].midi_message_released);
 		}
 
+		/* index the controls by MIDI message, for snd_hdjmp3_output_standard_packet() */
+		for (i = 0; i < DJ_MP3_NUM_OUTPUT_CONTROLS; i++) {
+			message = (u8*)&controller_state->control_details[i].midi_message_pressed;
+			if (controller_state->control_details[i].byte_number >= 
+				DJ_MP3_HID_OUTPUT_REPORT_LEN) {
+				snd_printk(KERN_WARNING"%s(): bad bytepos:%s, %d, ignoring control\n",
+					__FUNCTION__,
+					controller_state->control_details[i].name,
+					controller_state->control_details[i].byte_number);
+				continue;
+			}
+			if (message[0] < 0x80 || message[1] >= 0x80 ||
+			    controller_state->control_lookup[(message[0] >> 4) & 0x7][message[1]]!=0) {
+				continue;
+			}
+			controller_state->control_lookup[(message[0] >> 4) & 0x7][message[1]] = i + 1;
+		}
+
 		/* setup the HID report ID */
 		controller_state->current_hid_report_data[0] = DJ_MP3_HID_REPORT_ID;
 		controller_state->is_weltrend = is_mp3_weltrend(ep->umidi->chip->usb_id);
@@ -759,12 +818,23 @@ static int snd_hdjmidi_out_endpoint_create(struct snd_hdjmidi* umidi,
 	memset(ep,0,sizeof(*ep));
 	ep->umidi = umidi;
 	ep->endpoint_number = endpoint_number;
+	/* first, because the delete routine cancels it */
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(6,15,0) )
+	hrtimer_setup(&ep->render_delay_timer, midi_render_throttle_timer, 
+			CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&ep->render_delay_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ep->render_delay_timer.function = midi_render_throttle_timer;
+#endif
 
-	ep->urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!ep->urb) {
-		snd_printk(KERN_WARNING"%s() failed to allocate URB\n",__FUNCTION__);
-		snd_hdjmidi_out_endpoint_delete(ep);
-		return -ENOMEM;
+	ep->num_urbs = umidi->chip->product_code==DJCONTROLLER_PRODUCT_CODE ? 1 : OUTPUT_URBS;
+	for (i = 0; i < ep->num_urbs; ++i) {
+		ep->urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!ep->urbs[i]) {
+			snd_printk(KERN_WARNING"%s() failed to allocate URB\n",__FUNCTION__);
+			snd_hdjmidi_out_endpoint_delete(ep);
+			return -ENOMEM;
+		}
 	}
 	
 	/* used for clearing LEDs in midi close- no possibility to wait there, so
@@ -811,12 +881,26 @@ static int snd_hdjmidi_out_endpoint_create(struct snd_hdjmidi* umidi,
 		pipe = usb_sndctrlpipe(umidi->chip->dev, 0);
 	}
 	ep->max_transfer = usb_maxpacket(umidi->chip->dev, pipe, 1);
-	buffer = usb_alloc_coherent(umidi->chip->dev, ep->max_transfer,
-				  GFP_KERNEL, &ep->urb->transfer_dma);
-	if (!buffer) {
-		snd_printk(KERN_WARNING"%s() usb_alloc_coherent() failed\n",__FUNCTION__);
-		snd_hdjmidi_out_endpoint_delete(ep);
-		return -ENOMEM;
+	for (i = 0; i < ep->num_urbs; ++i) {
+		buffer = usb_alloc_coherent(umidi->chip->dev, ep->max_transfer,
+					  GFP_KERNEL, &ep->urbs[i]->transfer_dma);
+		if (!buffer) {
+			snd_printk(KERN_WARNING"%s() usb_alloc_coherent() failed\n",__FUNCTION__);
+			snd_hdjmidi_out_endpoint_delete(ep);
+			return -ENOMEM;
+		}
+		if (umidi->chip->product_code!=DJCONTROLLER_PRODUCT_CODE) {
+			if (ep_info->out_interval) {
+				usb_fill_int_urb(ep->urbs[i], umidi->chip->dev, pipe, buffer,
+						 ep->max_transfer, snd_hdjmidi_out_urb_complete,
+						 ep, ep_info->out_interval);
+			} else {
+				usb_fill_bulk_urb(ep->urbs[i], umidi->chip->dev,
+						  pipe, buffer, ep->max_transfer,
+						  snd_hdjmidi_out_urb_complete, ep);
+			}
+			ep->urbs[i]->transfer_flags = URB_NO_TRANSFER_DMA_MAP;
+		}
 	}
 	
 	buffer_led = usb_alloc_coherent(umidi->chip->dev, ep->max_transfer,
@@ -828,19 +912,9 @@ static int snd_hdjmidi_out_endpoint_create(struct snd_hdjmidi* umidi,
 		return -ENOMEM;
 	}
 	
-	if (umidi->chip->product_code!=DJCONTROLLER_PRODUCT_CODE) {
-		if (ep_info->out_interval) {
-			usb_fill_int_urb(ep->urb, umidi->chip->dev, pipe, buffer,
-					 ep->max_transfer, snd_hdjmidi_out_urb_complete,
-					 ep, ep_info->out_interval);
-		} else {
-			usb_fill_bulk_urb(ep->urb, umidi->chip->dev,
-					  pipe, buffer, ep->max_transfer,
-					  snd_hdjmidi_out_urb_complete, ep);
-		}
-		ep->urb->transfer_flags = URB_NO_TRANSFER_DMA_MAP;
-	} else {
-		usb_fill_control_urb(ep->urb, 
+	if (umidi->chip->product_code==DJCONTROLLER_PRODUCT_CODE) {
+		/* the mp3 has a single output URB, whose buffer was allocated above */
+		usb_fill_control_urb(ep->urbs[0], 
 				umidi->chip->dev, 
 				pipe,
 				(unsigned char *)ep->controller_state->ctl_req, 
@@ -857,9 +931,9 @@ static int snd_hdjmidi_out_endpoint_create(struct snd_hdjmidi* umidi,
 		ep->controller_state->ctl_req->wValue = cpu_to_le16((USB_HID_OUTPUT_REPORT << 8) + DJ_MP3_HID_REPORT_ID);
 		ep->controller_state->ctl_req->wIndex = cpu_to_le16(umidi->iface->cur_altsetting->desc.bInterfaceNumber);
 		ep->controller_state->ctl_req->wLength = cpu_to_le16(DJ_MP3_HID_OUTPUT_REPORT_LEN);
-		ep->urb->setup_dma = ep->controller_state->ctl_req_dma;
+		ep->urbs[0]->setup_dma = ep->controller_state->ctl_req_dma;
 		/* NOTE: transfer_dma setup above in call to usb_alloc_coherent() */
-		ep->urb->transfer_flags = URB_NO_TRANSFER_DMA_MAP;
+		ep->urbs[0]->transfer_flags = URB_NO_TRANSFER_DMA_MAP;
 	}
 	
 	if (ep->umidi->chip->caps.leds_hid_controlled) {
@@ -891,11 +965,6 @@ static int snd_hdjmidi_out_endpoint_create(struct snd_hdjmidi* umidi,
 
 	spin_lock_init(&ep->buffer_lock);
 	snd_hdjmidi_output_initialize_tasklet(ep);
-#ifdef THROTTLE_MP3_RENDER
-	init_timer(&ep->render_delay_timer);
-	ep->render_delay_timer.data = (unsigned long)ep;
-	ep->render_delay_timer.function = midi_render_throttle_timer;
-#endif
 
 	for (i = 0; i < 0x10; ++i)
 		if (ep_info->out_ep) {
@@ -1698,6 +1767,29 @@ static long hdjmidi_ioctl(struct file *file,
 			err = -EFAULT;
 		}
 	break;
+	case DJ_IOCTL_GET_OUTPUT_SHADOW_SIZE:
+		ioctl_trace_printk(KERN_INFO"%s() received IOCTL:  DJ_IOCTL_GET_OUTPUT_SHADOW_SIZE\n",
+					__FUNCTION__);
+		access = access_ok(VERIFY_WRITE,ioctl_param,sizeof(u32));
+		if (access) {
+			err = get_output_shadow_map_size(chip,&value32);
+			if (err==0) {
+				/*copy the kernel mode buffer to usermode*/
+				value32p_user = (u32 __user *)ioctl_param;
+				err = __put_user(value32, value32p_user);
+				if (err != 0) {
+					printk(KERN_WARNING"%s() ioctl received(), __put_user failed, result:%d\n",
+						__FUNCTION__,err);
+				}
+			} else {
+				printk(KERN_WARNING"%s() get_output_shadow_map_size() failed, rc:%d\n",
+						__FUNCTION__, err);	
+			}
+		} else {
+			printk(KERN_WARNING"%s() ioctl access_ok failed\n",__FUNCTION__);
+			err = -EFAULT;
+		}
+	break;
 	case DJ_IOCTL_SET_OUTPUT_CONTROL_DATA:
 #ifdef CONFIG_COMPAT
 	case DJ_IOCTL_SET_OUTPUT_CONTROL_DATA32:
@@ -1753,6 +1845,23 @@ static long hdjmidi_ioctl(struct file *file,
 						__FUNCTION__, err);
 		}
 	break;
+	case DJ_IOCTL_SET_OUTPUT_CONTROL_VECTOR:
+#ifdef CONFIG_COMPAT
+	case DJ_IOCTL_SET_OUTPUT_CONTROL_VECTOR32:
+#endif
+		if (compat_mode==0) {
+			ioctl_trace_printk(KERN_INFO"%s() received IOCTL:  DJ_IOCTL_SET_OUTPUT_CONTROL_VECTOR\n",
+						__FUNCTION__);
+		} else {
+			ioctl_trace_printk(KERN_INFO"%s() received IOCTL:  DJ_IOCTL_SET_OUTPUT_CONTROL_VECTOR32\n",
+						__FUNCTION__);
+		}
+		err = send_control_output_vector(chip, (void __user *)ioctl_param);
+		if (err!=0) {
+			printk(KERN_WARNING"%s() send_control_output_vector failed(), rc:%d\n",
+				__FUNCTION__,err);
+		}
+	break;
 	case DJ_IOCTL_GET_OUTPUT_CONTROL_DATA:
 #ifdef CONFIG_COMPAT
 	case DJ_IOCTL_GET_OUTPUT_CONTROL_DATA32:
@@ -1810,11 +1919,37 @@ static long hdjmidi_ioctl_entry_compat(struct file *file,
 }
 #endif
 
+/* the only mapping is the shared output control page */
+static int hdjmidi_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int ret;
+	int chip_index;
+	struct snd_hdj_chip* chip=NULL;
+
+	chip_index = (int)(unsigned long)file->private_data;
+	chip = inc_chip_ref_count(chip_index);
+	if (!chip) {
+		printk(KERN_WARNING"%s() no context, bailing!\n",__FUNCTION__);
+		return -ENODEV;
+	}
+
+	if (vma->vm_pgoff!=(DJ_OUTPUT_SHADOW_MMAP_OFFSET>>PAGE_SHIFT)) {
+		printk(KERN_WARNING"%s() invalid mapping, offset:%lu\n",__FUNCTION__,vma->vm_pgoff);
+		ret = -EINVAL;
+	} else {
+		ret = map_output_shadow(chip, vma);
+	}
+
+	dec_chip_ref_count(chip_index);
+	return ret;
+}
+
 static const struct file_operations snd_hdjmidi_fops =
 {
 			.owner =        THIS_MODULE,
 	        .open =         hdjmidi_open,
 	        .release =      hdjmidi_release,
+	        .mmap =         hdjmidi_mmap,
 #ifdef CONFIG_COMPAT
 			.compat_ioctl = hdjmidi_ioctl_entry_compat,
 #endif
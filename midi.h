@@ -115,6 +115,27 @@ struct midi_channel_elem
 #define MAX_MIDI_CHANNEL			(NUM_MIDI_CHANNELS-1)
 #define MIDI_INVALID_CHANNEL			NUM_MIDI_CHANNELS
 
+/* MIDI parser states of input and output ports */
+#define STATE_UNKNOWN	0
+#define STATE_1PARAM	1
+#define STATE_2PARAM_1	2
+#define STATE_2PARAM_2	3
+#define STATE_SYSEX_0	4
+#define STATE_SYSEX_1	5
+#define STATE_SYSEX_2	6
+
+/* Classification of every MIDI byte, shared by capture and render so that both directions
+ *  parse alike.  The low bits hold the state which a port enters after the byte. */
+#define MIDI_CLASS_STATE_MASK	0x007
+#define MIDI_CLASS_DATA		0x008	/* data byte, its meaning depends on the port state */
+#define MIDI_CLASS_STATUS	0x010	/* starts a message, and is held in data[0] */
+#define MIDI_CLASS_CHANNEL	0x020	/* channel message, whose channel we may rewrite */
+#define MIDI_CLASS_SINGLE	0x040	/* complete message of a single byte */
+#define MIDI_CLASS_KEEP_STATE	0x080	/* real time, does not disturb the message in progress */
+#define MIDI_CLASS_SYSEX_END	0x100	/* completes the sysex in progress */
+
+extern const u16 snd_hdjmidi_byte_class[256];
+
 /* used for temporarily storing information to create pipes and URBs */
 struct snd_hdjmidi_endpoint_info {
 	int8_t   out_ep;	/* ep number, 0 autodetect */
@@ -149,6 +170,10 @@ struct controller_output_hid {
 	struct controller_control_details *control_details;
 	u32		num_controls;
 
+	/* Control number plus 1 of each control change message, indexed by the status nibble 
+	 *  (less 0x8) and the first data byte, or 0 when no control maps to the message */
+	u8 control_lookup[8][128];
+
 	/* is mp3 based on weltrend chip or not */
 	u8 is_weltrend;
 
@@ -182,16 +207,20 @@ struct controller_output_hid {
 	atomic_t poll_period_jiffies;
 };
 
-/* This is recommended, because the mp3 is actually HID, with a 8ms period- so
- *  therefore it is highly recommended not to exceed this.  Our other devices are
- *  MIDI, and NAK us if we exceed the MIDI rate */
-#define THROTTLE_MP3_RENDER
-#define THROTTLE_MP3_RENDER_RATE			8 /* ms */
+/* MIDI output URBs kept in flight per endpoint, so that rawmidi data is pipelined.  HID only
+ *  controllers (the mp3) send their whole LED state in each report, and use only one. */
+#define OUTPUT_URBS	4
+
+/* bytes which each active output port may send per scheduling round, a few channel messages */
+#define OUTPUT_PORT_QUANTUM	16
+/* most bytes taken from a rawmidi output buffer at once */
+#define OUTPUT_RUN_SIZE		64
 
 struct snd_hdjmidi_out_endpoint {
 	struct snd_hdjmidi* umidi;
-	struct urb* urb; /* this is used for MIDI output*/
-	int urb_active; /* relates to MIDI output URB */
+	struct urb* urbs[OUTPUT_URBS]; /* these are used for MIDI output */
+	int num_urbs;
+	unsigned int active_urbs; /* bitmask of the MIDI output URBs in flight */
 	int max_transfer;		/* size of urb buffer */
 	struct tasklet_struct tasklet;
 	
@@ -206,10 +235,10 @@ struct snd_hdjmidi_out_endpoint {
 	
 	int endpoint_number;
 	
-#ifdef THROTTLE_MP3_RENDER
-	struct timer_list render_delay_timer;
-	unsigned long last_send_time;
-#endif
+	/* HID only controllers (the mp3) render through the chip's output bucket, and this
+	 *  resumes output once a token is available.  Our other devices are MIDI, and NAK us
+	 *  if we exceed the MIDI rate. */
+	struct hrtimer render_delay_timer;
 
 	struct hdjmidi_out_port {
 		struct snd_hdjmidi_out_endpoint* ep;
@@ -219,17 +248,11 @@ struct snd_hdjmidi_out_endpoint {
 		snd_rawmidi_substream_t* substream;
 #endif
 		int active;
-		uint8_t state;
-#define STATE_UNKNOWN	0
-#define STATE_1PARAM	1
-#define STATE_2PARAM_1	2
-#define STATE_2PARAM_2	3
-#define STATE_SYSEX_0	4
-#define STATE_SYSEX_1	5
-#define STATE_SYSEX_2	6
+		uint8_t state; /* STATE_* */
 		uint8_t data[2];
+		int deficit; /* bytes which the port may still send in this round */
 	} ports[0x10];
-	int current_port;
+	int current_port; /* the port which the next output round starts with */
 
 	/* will only be used for MP3 and other HID only controlers, otherwise is NULL */
 	struct controller_output_hid *controller_state;
@@ -274,8 +297,17 @@ struct controller_input_hid {
 	/* input control details */
 	struct controller_control_details *control_details;
 	u32 num_controls;
+
+	/* Control numbers ordered by the report byte which holds them, so that parsing only
+	 *  visits the controls of changed bytes.  Those of byte n are at byte_controls_start[n] 
+	 *  up to byte_controls_start[n+1]. */
+	u8 byte_controls_start[DJ_MP3_HID_INPUT_REPORT_LEN+1];
+	u8 byte_controls[DJ_MP3_NUM_INPUT_CONTROLS];
 };
 
+/* most bytes of parsed MIDI input passed to ALSA at once */
+#define INPUT_RUN_SIZE		128
+
 struct snd_hdjmidi_in_endpoint {
 	struct snd_hdjmidi* umidi;
 	struct urb* urb;
@@ -290,14 +322,7 @@ struct snd_hdjmidi_in_endpoint {
 		 *  applicable.  This is required mostly for the DJC, which has physical MIDI ports
 	 	 *  and can send fragmented MIDI messages.
 		 */
-		uint8_t state;
-#define STATE_UNKNOWN	0
-#define STATE_1PARAM	1
-#define STATE_2PARAM_1	2
-#define STATE_2PARAM_2	3
-#define STATE_SYSEX_0	4
-#define STATE_SYSEX_1	5
-#define STATE_SYSEX_2	6
+		uint8_t state; /* STATE_* */
 		uint8_t data[3];
 		uint8_t midi_message_ready;
 		uint8_t midi_message_len;
@@ -314,7 +339,7 @@ struct snd_hdjmidi_in_endpoint {
 
 struct usb_protocol_ops {
 	void (*input)(struct snd_hdjmidi_in_endpoint*, uint8_t*, int);
-	void (*output)(struct snd_hdjmidi_out_endpoint*);
+	void (*output)(struct snd_hdjmidi_out_endpoint*, struct urb*);
 	void (*output_packet)(struct urb*, uint8_t, uint8_t, uint8_t, uint8_t);
 	void (*init_out_endpoint)(struct snd_hdjmidi_out_endpoint*);
 	void (*finish_out_endpoint)(struct snd_hdjmidi_out_endpoint*);
@@ -94,87 +94,15 @@ static void snd_hdjmidi_input_data(struct snd_hdjmidi_in_endpoint* ep,
 }
 
 /*
- * Converts MIDI bytes to MIDI messages, and implants current MIDI channel if applicable 
+ * Converts MIDI bytes to MIDI messages, and implants midi_channel if it is valid
  */
-static void snd_hdjmidi_capture_byte(struct snd_hdjmidi* umidi,
-				     struct hdjmidi_in_port* port,
-				     uint8_t b)
+static void snd_hdjmidi_capture_byte(struct hdjmidi_in_port* port,
+				     uint8_t b,
+				     int midi_channel)
 {
-	int midi_channel;
-	if (b >= 0xf8) {
-		port->data[0] = b;
-		port->midi_message_len = 1;
-		port->midi_message_ready = 1;
-	} else if (b >= 0xf0) {
-		switch (b) {
-		case 0xf0:
-			port->midi_message_len = 1;
-			port->data[0] = b;
-			port->state = STATE_SYSEX_1;
-			break;
-		case 0xf1:
-		case 0xf3:
-			port->midi_message_len = 1;
-			port->data[0] = b;
-			port->state = STATE_1PARAM;
-			break;
-		case 0xf2:
-			port->midi_message_len = 1;
-			port->data[0] = b;
-			port->state = STATE_2PARAM_1;
-			break;
-		case 0xf4:
-		case 0xf5:
-			port->state = STATE_UNKNOWN;
-			break;
-		case 0xf6:
-			port->data[0] = b;
-			port->midi_message_len = 1;
-			port->midi_message_ready = 1;
-			port->state = STATE_UNKNOWN;
-			break;
-		case 0xf7:
-			switch (port->state) {
-			case STATE_SYSEX_0:
-				port->data[0] = b;
-				port->midi_message_len = 1;
-				port->midi_message_ready = 1;
-				break;
-			case STATE_SYSEX_1:
-				port->data[1] = b;
-				port->midi_message_len = 2;
-				port->midi_message_ready = 1;
-				break;
-			case STATE_SYSEX_2:
-				port->data[2] = b;
-				port->midi_message_len = 3;
-				port->midi_message_ready = 1;
-				break;
-			}
-			port->state = STATE_UNKNOWN;
-			break;
-		}
-	} else if (b >= 0x80) {
-		port->data[0] = b;
-		port->midi_message_len = 1;
-		midi_channel = atomic_read(&umidi->channel);
-		/* Put in MIDI channel except for:
-		 * - Device with non-volatile storage for MIDI channel, as the firmware sends it already.
-		 * - We have no valid MIDI channel to assign.
-		 * - We are in physical port mode, in which case we are a simple conduit, and don't
-		 *    touch the data.
-		 */
-		if (midi_channel!=MIDI_INVALID_CHANNEL &&
-		   umidi->chip->caps.non_volatile_channel!=1 &&
-		   atomic_read(&umidi->midi_mode)!=MIDI_MODE_PHYSICAL_PORT) {
-			port->data[0] &= 0xf0;
-			port->data[0] |= midi_channel&0xf;
-		}
-		if (b >= 0xc0 && b <= 0xdf)
-			port->state = STATE_1PARAM;
-		else
-			port->state = STATE_2PARAM_1;
-	} else { /* b < 0x80 */
+	u16 class = snd_hdjmidi_byte_class[b];
+
+	if (class & MIDI_CLASS_DATA) {
 		switch (port->state) {
 		case STATE_1PARAM:
 			if (port->data[0] >= 0xf0) {
@@ -216,6 +144,41 @@ static void snd_hdjmidi_capture_byte(struct snd_hdjmidi* umidi,
 			port->state = STATE_SYSEX_0;
 			break;
 		}
+		return;
+	}
+
+	if (class & MIDI_CLASS_SINGLE) {
+		port->data[0] = b;
+		port->midi_message_len = 1;
+		port->midi_message_ready = 1;
+	} else if (class & MIDI_CLASS_SYSEX_END) {
+		switch (port->state) {
+		case STATE_SYSEX_0:
+			port->data[0] = b;
+			port->midi_message_len = 1;
+			port->midi_message_ready = 1;
+			break;
+		case STATE_SYSEX_1:
+			port->data[1] = b;
+			port->midi_message_len = 2;
+			port->midi_message_ready = 1;
+			break;
+		case STATE_SYSEX_2:
+			port->data[2] = b;
+			port->midi_message_len = 3;
+			port->midi_message_ready = 1;
+			break;
+		}
+	} else if (class & MIDI_CLASS_STATUS) {
+		port->data[0] = b;
+		port->midi_message_len = 1;
+		if ((class & MIDI_CLASS_CHANNEL) && midi_channel!=MIDI_INVALID_CHANNEL) {
+			port->data[0] &= 0xf0;
+			port->data[0] |= midi_channel&0xf;
+		}
+	}
+	if (!(class & MIDI_CLASS_KEEP_STATE)) {
+		port->state = class & MIDI_CLASS_STATE_MASK;
 	}
 }
 
@@ -223,96 +186,105 @@ void snd_hdjmidi_standard_input(struct snd_hdjmidi_in_endpoint* ep,
 				uint8_t* buffer, 
 				int buffer_length)
 {
+	/* all our devices have 1 port- no port indicator sent in buffer from device */
+	struct hdjmidi_in_port* port = &ep->ports[0];
+	struct snd_hdjmidi* umidi = ep->umidi;
+	/* completed messages are gathered here, and handed to ALSA with one call per URB */
+	uint8_t run[INPUT_RUN_SIZE];
+	int run_length = 0;
+	int midi_channel;
 	int i;
+
+	/* Put in MIDI channel except for:
+	 * - Device with non-volatile storage for MIDI channel, as the firmware sends it already.
+	 * - We have no valid MIDI channel to assign.
+	 * - We are in physical port mode, in which case we are a simple conduit, and don't
+	 *    touch the data.
+	 */
+	midi_channel = atomic_read(&umidi->channel);
+	if (umidi->chip->caps.non_volatile_channel==1 ||
+	   atomic_read(&umidi->midi_mode)==MIDI_MODE_PHYSICAL_PORT) {
+		midi_channel = MIDI_INVALID_CHANNEL;
+	}
+
 	for (i=0;i<buffer_length;i++) {
-		/* all our devices have 1 port- no port indicator sent in buffer from device */
-		snd_hdjmidi_capture_byte(ep->umidi,&ep->ports[0],buffer[i]);
-		if (ep->ports[0].midi_message_ready==1) {
-			snd_hdjmidi_input_data(ep, 0, ep->ports[0].data,  ep->ports[0].midi_message_len);
-			ep->ports[0].midi_message_ready = 0;
-			ep->ports[0].midi_message_len = 0;
+		snd_hdjmidi_capture_byte(port,buffer[i],midi_channel);
+		if (port->midi_message_ready==1) {
+			/* running status is expanded, so the run may outgrow the URB's data */
+			if (run_length + port->midi_message_len > INPUT_RUN_SIZE) {
+				snd_hdjmidi_input_data(ep, 0, run, run_length);
+				run_length = 0;
+			}
+			memcpy(run + run_length, port->data, port->midi_message_len);
+			run_length += port->midi_message_len;
+			port->midi_message_ready = 0;
+			port->midi_message_len = 0;
 		}
 	}
+	if (run_length > 0) {
+		snd_hdjmidi_input_data(ep, 0, run, run_length);
+	}
 }
 
-/* This is called by PSOC and weltrend clients, and always with a full buffer */
+/* This is called by PSOC and weltrend clients, and always with a full buffer.  Only the
+ *  controls of bytes which differ from the last report are visited. */
 static void snd_hdjmp3_core_parse_input(struct snd_hdjmidi_in_endpoint* ep,
 		   			 uint8_t* buffer, 
 		 			 int buffer_length)
 {
+	struct controller_input_hid *controller_state = ep->controller_state;
+	struct controller_control_details *details;
+	u8 *last = controller_state->last_hid_report_data;
 	unsigned int control_num = 0;
 	unsigned int bytepos=0;
-	unsigned int bitpos=0;
-	unsigned int bitmask=0;
-	unsigned int max_index = DJ_MP3_HID_INPUT_REPORT_LEN-1;
+	unsigned int i;
+	unsigned char changed = 0;
 	unsigned char inc_value = 0;
 	int midi_channel;
 	u32 midi_code_to_send = 0;
 	struct hdjmidi_in_port* port = &ep->ports[0]; /* only 1 port */
 	
-	for (control_num = 0 ; control_num < DJ_MP3_NUM_INPUT_CONTROLS; control_num++) {
-		bytepos = ep->controller_state->control_details[control_num].byte_number;
-		if (bytepos>max_index) {
-			snd_printk(KERN_INFO"%s(): bad bytepos:%s, %d\n",
-				__FUNCTION__,
-				ep->controller_state->control_details[control_num].name,
-				bytepos);
+	midi_channel = atomic_read(&ep->umidi->channel);
+	for (bytepos = 0 ; bytepos < DJ_MP3_HID_INPUT_REPORT_LEN; bytepos++) {
+		changed = buffer[bytepos] ^ last[bytepos];
+		if (changed==0) {
 			continue;
 		}
-		bitpos = ep->controller_state->control_details[control_num].bit_number;
-		bitmask = 1 << bitpos;
-		if ( (ep->controller_state->control_details[control_num].type==TYPE_BUTTON) &&
-		     ((buffer[bytepos]&bitmask) != 
-		     (ep->controller_state->last_hid_report_data[bytepos]&bitmask)) ) {
-			if ( (buffer[bytepos]&bitmask) != 0 ) {
-				midi_code_to_send = ep->controller_state->control_details[control_num].midi_message_pressed;
+		for (i = controller_state->byte_controls_start[bytepos];
+		     i < controller_state->byte_controls_start[bytepos+1]; i++) {
+			control_num = controller_state->byte_controls[i];
+			details = &controller_state->control_details[control_num];
+			if (details->type==TYPE_BUTTON) {
+				if ((changed & (1 << details->bit_number))==0) {
+					continue;
+				}
+				if ( (buffer[bytepos] & (1 << details->bit_number)) != 0 ) {
+					midi_code_to_send = details->midi_message_pressed;
+				} else {
+					midi_code_to_send = details->midi_message_released;
+				}
+			} else if (details->type==TYPE_LINEAR) {
+				midi_code_to_send = details->midi_message_released;
+				((u8*)&midi_code_to_send)[2] = buffer[bytepos] >> 1;
+			} else if (details->type==TYPE_INCREMENTAL) {
+				inc_value = buffer[bytepos]-last[bytepos];
+				if (inc_value > 0x7f) {
+					inc_value &= 0x7f;
+				}
+				midi_code_to_send = details->midi_message_released;
+				((u8*)&midi_code_to_send)[2] = inc_value;
 			} else {
-				midi_code_to_send = ep->controller_state->control_details[control_num].midi_message_released;
+				continue;
 			}
-			
-			midi_channel = atomic_read(&ep->umidi->channel);
 			((u8*)&midi_code_to_send)[0] &= 0xf0;
 			((u8*)&midi_code_to_send)[0] |= midi_channel&0xf;
-			atomic_set(&ep->controller_state->control_details[control_num].value,midi_code_to_send);
+			atomic_set(&details->value,midi_code_to_send);
 			
 			if (test_bit(port->substream->number, &ep->umidi->input_triggered)) {
 				snd_rawmidi_receive(port->substream, 
 						(unsigned char*)&midi_code_to_send, 
 						3);
 			}
-		} else if (ep->controller_state->control_details[control_num].type==TYPE_LINEAR &&
-			   (buffer[bytepos]!=ep->controller_state->last_hid_report_data[bytepos])) {
-			midi_code_to_send = ep->controller_state->control_details[control_num].midi_message_released;
-			midi_channel = atomic_read(&ep->umidi->channel);
-			((u8*)&midi_code_to_send)[0] &= 0xf0;
-			((u8*)&midi_code_to_send)[0] |= midi_channel&0xf;
-			memset(((unsigned char*)&midi_code_to_send)+2,buffer[bytepos] >> 1,1);
-			atomic_set(&ep->controller_state->control_details[control_num].value,midi_code_to_send);
-			
-			if (test_bit(port->substream->number, &ep->umidi->input_triggered)) {
-				snd_rawmidi_receive(port->substream, 
-					(unsigned char*)&midi_code_to_send, 
-					3);
-			}
-		}
-		else if (ep->controller_state->control_details[control_num].type==TYPE_INCREMENTAL &&
-			   (buffer[bytepos]!=ep->controller_state->last_hid_report_data[bytepos])) {
-			inc_value = buffer[bytepos]-ep->controller_state->last_hid_report_data[bytepos];
-			if (inc_value > 0x7f) {
-				inc_value &= 0x7f;
-			}
-			midi_code_to_send = ep->controller_state->control_details[control_num].midi_message_released;
-			midi_channel = atomic_read(&ep->umidi->channel);
-			((u8*)&midi_code_to_send)[0] &= 0xf0;
-			((u8*)&midi_code_to_send)[0] |= midi_channel&0xf;
-			memset(((unsigned char*)&midi_code_to_send)+2,inc_value,1);
-			atomic_set(&ep->controller_state->control_details[control_num].value,midi_code_to_send);
-
-			if (test_bit(port->substream->number, &ep->umidi->input_triggered)) {
-				snd_rawmidi_receive(port->substream, 
-					(unsigned char*)&midi_code_to_send, 
-					3);
-			}
 		}
 	}
 }
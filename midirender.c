@@ -33,6 +33,7 @@
 #include <linux/usb.h>
 #include <asm/atomic.h>
 #include <linux/kthread.h>
+#include <linux/hrtimer.h>
 #if ( LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,24) )
 #include <sound/driver.h>
 #endif
@@ -76,6 +77,8 @@ static void dump_urb(const char *type, const u8 *data, int length)
 void snd_hdjmidi_output_kill_tasklet(struct snd_hdjmidi_out_endpoint* ep)
 {
 	if (ep) {
+		/* the throttle timer schedules the tasklet */
+		hrtimer_cancel(&ep->render_delay_timer);
 		tasklet_kill(&ep->tasklet);
 	}
 }
@@ -90,8 +93,12 @@ void snd_hdjmidi_output_initialize_tasklet(struct snd_hdjmidi_out_endpoint* ep)
 void snd_hdjmidi_output_kill_urbs(struct snd_hdjmidi_out_endpoint* ep)
 {
 	if (ep) {
-		if (ep->urb!=NULL) {
-			usb_kill_urb(ep->urb);
+		int i;
+
+		for (i = 0; i < ep->num_urbs; ++i) {
+			if (ep->urbs[i]!=NULL) {
+				usb_kill_urb(ep->urbs[i]);
+			}
 		}
 		if (ep->controller_state!=NULL && ep->controller_state->urb_kt!=NULL) {
 			usb_kill_urb(ep->controller_state->urb_kt);
@@ -100,74 +107,17 @@ void snd_hdjmidi_output_kill_urbs(struct snd_hdjmidi_out_endpoint* ep)
 }
 
 /*
- * Converts MIDI commands to USB MIDI packets.
+ * Converts MIDI commands to USB MIDI packets, and implants midi_channel if it is valid
  */
 static void snd_hdjmidi_transmit_byte(struct hdjmidi_out_port* port,
 				      uint8_t b, struct urb* urb,
-				      struct snd_hdjmidi_out_endpoint* ep)
+				      int midi_channel)
 {
-	int midi_channel;
+	u16 class = snd_hdjmidi_byte_class[b];
 	void (*output_packet)(struct urb*, uint8_t, uint8_t, uint8_t, uint8_t) =
 		port->ep->umidi->usb_protocol_ops->output_packet;
 	
-	if (b >= 0xf8) {
-		output_packet(urb, b, 0, 0, 1);
-	} else if (b >= 0xf0) {
-		switch (b) {
-		case 0xf0:
-			port->data[0] = b;
-			port->state = STATE_SYSEX_1;
-			break;
-		case 0xf1:
-		case 0xf3:
-			port->data[0] = b;
-			port->state = STATE_1PARAM;
-			break;
-		case 0xf2:
-			port->data[0] = b;
-			port->state = STATE_2PARAM_1;
-			break;
-		case 0xf4:
-		case 0xf5:
-			port->state = STATE_UNKNOWN;
-			break;
-		case 0xf6:
-			output_packet(urb, 0xf6, 0, 0, 1);
-			port->state = STATE_UNKNOWN;
-			break;
-		case 0xf7:
-			switch (port->state) {
-			case STATE_SYSEX_0:
-				output_packet(urb, 0xf7, 0, 0, 1);
-				break;
-			case STATE_SYSEX_1:
-				output_packet(urb, port->data[0], 0xf7, 0, 2);
-				break;
-			case STATE_SYSEX_2:
-				output_packet(urb, port->data[0], port->data[1], 0xf7, 3);
-				break;
-			}
-			port->state = STATE_UNKNOWN;
-			break;
-		}
-	} else if (b >= 0x80) {
-		port->data[0] = b;
-		midi_channel = atomic_read(&ep->umidi->channel);
-		/* Put in MIDI channel for the case of the devices with MIDI channel non-volatile storage:
-		 *  The firmware expects the same channel which it has been submitted to it during
-		 *  MIDI initialization (through the correct vendor request).  If we have failed to 
-		 *  set the MIDI channel in the device for some reason, then we do nothing.  
-		 */
-		if (midi_channel!=MIDI_INVALID_CHANNEL &&
-		   ep->umidi->chip->caps.non_volatile_channel==1) {
-			port->data[0] &= 0xf0;
-			port->data[0] |= midi_channel&0xf;
-		}
-		if (b >= 0xc0 && b <= 0xdf)
-			port->state = STATE_1PARAM;
-		else
-			port->state = STATE_2PARAM_1;
-	} else { /* b < 0x80 */
+	if (class & MIDI_CLASS_DATA) {
 		switch (port->state) {
 		case STATE_1PARAM:
 			if (port->data[0] >= 0xf0) {
@@ -200,32 +150,100 @@ static void snd_hdjmidi_transmit_byte(struct hdjmidi_out_port* port,
 			port->state = STATE_SYSEX_0;
 			break;
 		}
+		return;
+	}
+
+	if (class & MIDI_CLASS_SINGLE) {
+		output_packet(urb, b, 0, 0, 1);
+	} else if (class & MIDI_CLASS_SYSEX_END) {
+		switch (port->state) {
+		case STATE_SYSEX_0:
+			output_packet(urb, 0xf7, 0, 0, 1);
+			break;
+		case STATE_SYSEX_1:
+			output_packet(urb, port->data[0], 0xf7, 0, 2);
+			break;
+		case STATE_SYSEX_2:
+			output_packet(urb, port->data[0], port->data[1], 0xf7, 3);
+			break;
+		}
+	} else if (class & MIDI_CLASS_STATUS) {
+		port->data[0] = b;
+		if ((class & MIDI_CLASS_CHANNEL) && midi_channel!=MIDI_INVALID_CHANNEL) {
+			port->data[0] &= 0xf0;
+			port->data[0] |= midi_channel&0xf;
+		}
+	}
+	if (!(class & MIDI_CLASS_KEEP_STATE)) {
+		port->state = class & MIDI_CLASS_STATE_MASK;
 	}
 }
 
-void snd_hdjmidi_standard_output(struct snd_hdjmidi_out_endpoint* ep)
+void snd_hdjmidi_standard_output(struct snd_hdjmidi_out_endpoint* ep, struct urb* urb)
 {
-	struct urb* urb = ep->urb;
-	int p;
+	int i, j, p, active, count;
+	int midi_channel;
+	uint8_t run[OUTPUT_RUN_SIZE];
 
-	/* Note: Hercules DJ products only have one output port thus far, so this is not urgent.
-	 *       The only exception is the DJ Console "Mac Ed.", which is USBMIDI, and so is managed by
-  	 *       system modules and not us.
+	/* Note: Hercules DJ products only have one output port thus far.  The only exception is 
+	 *       the DJ Console "Mac Ed.", which is USBMIDI, and so is managed by system modules and 
+	 *       not us.
 	 */
-	/* FIXME: lower-numbered ports can starve higher-numbered ports */
-	for (p = 0; p < 0x10; ++p) {
-		struct hdjmidi_out_port* port = &ep->ports[p];
-		if (!port->active)
-			continue;
-		while (urb->transfer_buffer_length + 3 < ep->max_transfer) {
-			uint8_t b;
-			if (snd_rawmidi_transmit(port->substream, &b, 1) != 1) {
-				port->active = 0;
-				break;
+	/* Put in MIDI channel for the case of the devices with MIDI channel non-volatile storage:
+	 *  The firmware expects the same channel which it has been submitted to it during
+	 *  MIDI initialization (through the correct vendor request).  If we have failed to 
+	 *  set the MIDI channel in the device for some reason, then we do nothing.  
+	 */
+	midi_channel = atomic_read(&ep->umidi->channel);
+	if (ep->umidi->chip->caps.non_volatile_channel!=1) {
+		midi_channel = MIDI_INVALID_CHANNEL;
+	}
+
+	/* Deficit round-robin: in each round every active port earns OUTPUT_PORT_QUANTUM bytes and
+	 *  sends as many as it has earned, so that no port can starve the others.  Rounds start
+	 *  after the port which was served when the previous URB filled up. */
+	do {
+		active = 0;
+		for (i = 0; i < 0x10; ++i) {
+			struct hdjmidi_out_port* port;
+			p = (ep->current_port + i) & 0xf;
+			port = &ep->ports[p];
+			if (!port->active)
+				continue;
+			port->deficit += OUTPUT_PORT_QUANTUM;
+			while (port->deficit > 0) {
+				/* A run of bytes produces at most as many bytes of packets, plus the 2
+				 *  which the port may be holding back from an incomplete message.  The
+				 *  packet writer always stores 3 bytes, so a 1 byte packet needs 2 more. */
+				count = ep->max_transfer - urb->transfer_buffer_length - 4;
+				if (count <= 0) {
+					/* what this port has not spent yet carries over */
+					ep->current_port = (p + 1) & 0xf;
+					return;
+				}
+				if (count > port->deficit)
+					count = port->deficit;
+				if (count > OUTPUT_RUN_SIZE)
+					count = OUTPUT_RUN_SIZE;
+				/* take the whole run from the rawmidi buffer at once */
+				count = snd_rawmidi_transmit_peek(port->substream, run, count);
+				if (count <= 0) {
+					port->active = 0;
+					break;
+				}
+				for (j = 0; j < count; ++j)
+					snd_hdjmidi_transmit_byte(port, run[j], urb, midi_channel);
+				snd_rawmidi_transmit_ack(port->substream, count);
+				port->deficit -= count;
+			}
+			if (port->active) {
+				active = 1;
+			} else {
+				/* an idle port does not save up credit */
+				port->deficit = 0;
 			}
-			snd_hdjmidi_transmit_byte(port, b, urb, ep);
 		}
-	}
+	} while (active);
 }
 
 void snd_hdjmidi_output_standard_packet(struct urb* urb, 
@@ -333,12 +351,13 @@ void snd_hdjmp3_output_standard_packet(struct urb* urb,
 	int control_num;
 	uint8_t* buf = (uint8_t*)urb->transfer_buffer;
 	struct snd_hdjmidi_out_endpoint* ep = (struct snd_hdjmidi_out_endpoint*)urb->context;
-	u32 message=0;
+	struct controller_control_details *details = NULL;
 	unsigned long flags;
 	unsigned int bytepos=0;
-	unsigned int bitpos=0;
 	unsigned int bitmask=0;
-	unsigned int max_index = DJ_MP3_HID_OUTPUT_REPORT_LEN-1;
+	int value = 0;
+	int blink = 0;
+	int flush = 0;
 	u8 set_left_play_blink = 0;
 	u8 set_right_play_blink = 0;
 
@@ -360,70 +379,68 @@ void snd_hdjmp3_output_standard_packet(struct urb* urb,
 	/* We only service control change messages, anything else is silently drained and dropped.  We
 	 *  map appropriate control change messages to HID output report calls (which are control requests) 
 	 */
-	if (len==3) {
-		/* remove the channel from b0 */
-		message = (b0&0xf0) | (b1 << 8);
-		
-		for(control_num=0; control_num < DJ_MP3_NUM_OUTPUT_CONTROLS; control_num++) {
-			if (memcmp(&ep->controller_state->control_details[control_num].midi_message_pressed,
-				  &message,
-				  2)==0) {
-				bytepos = ep->controller_state->control_details[control_num].byte_number;
-				if (bytepos>max_index) {
-					snd_printk(KERN_INFO"%s(): bad bytepos:%s, %d\n",
-						__FUNCTION__,
-						ep->controller_state->control_details[control_num].name,
-						bytepos);
-					continue;
-				}
-				bitpos = ep->controller_state->control_details[control_num].bit_number;
-				bitmask = 1 << bitpos;
-				if (b2==((uint8_t*)&ep->controller_state->control_details[control_num].midi_message_pressed)[2]) {
-					spin_lock_irqsave(&ep->controller_state->hid_buffer_lock, flags);
-					ep->controller_state->current_hid_report_data[bytepos] |= bitmask;
-					spin_unlock_irqrestore(&ep->controller_state->hid_buffer_lock, flags);
-					/* we may have other routines checking values via atomic API */
-					atomic_set(&ep->controller_state->control_details[control_num].value, 1);
-					/* check LED blink case- left and right */
-					if (ep->controller_state->control_details[control_num].control_id==MP3_OUT_PLAY_PAUSE_BLINK_L) {	
-						set_left_play_blink = 1;
-					}	
-					if (ep->controller_state->control_details[control_num].control_id==MP3_OUT_PLAY_PAUSE_BLINK_R) {	
-						set_right_play_blink = 1;
-					}
+	if (len==3 && b0 >= 0x80 && b1 < 0x80) {
+		/* the channel is ignored */
+		control_num = ep->controller_state->control_lookup[(b0 >> 4) & 0x7][b1] - 1;
+		if (control_num >= 0) {
+			details = &ep->controller_state->control_details[control_num];
+			if (b2==((uint8_t*)&details->midi_message_pressed)[2]) {
+				value = 1;
+				/* check LED blink case- left and right */
+				if (details->control_id==MP3_OUT_PLAY_PAUSE_BLINK_L) {	
+					set_left_play_blink = 1;
+				}	
+				if (details->control_id==MP3_OUT_PLAY_PAUSE_BLINK_R) {	
+					set_right_play_blink = 1;
 				}
-				else if (b2==((uint8_t*)&ep->controller_state->control_details[control_num].midi_message_released)[2]) {
-					spin_lock_irqsave(&ep->controller_state->hid_buffer_lock, flags);
-					ep->controller_state->current_hid_report_data[bytepos] &= ~bitmask;
-					spin_unlock_irqrestore(&ep->controller_state->hid_buffer_lock, flags);
-					/* we may have other routines checking values via atomic API */
-					atomic_set(&ep->controller_state->control_details[control_num].value, 0);
-				} else {
+			} else if (b2==((uint8_t*)&details->midi_message_released)[2]) {
+				value = 0;
+			} else {
+				details = NULL;
+			}
+		}
+	}
 
-					continue;
-				}
-				/* for FLUSH Analogs */
-				if (ep->controller_state->control_details[control_num].control_id==MP3_OUT_FLUSH_ANALOGS) {
-					snd_hdjmp3_flush_analogs(ep);
-					break;
-				}
+	if (details!=NULL) {
+		bytepos = details->byte_number;
+		bitmask = 1 << details->bit_number;
+		/* we may have other routines checking values via atomic API */
+		atomic_set(&details->value, value);
+		flush = details->control_id==MP3_OUT_FLUSH_ANALOGS;
+		blink = atomic_read(&ep->controller_state->control_details[MP3_OUT_PLAY_PAUSE_BLINK_L].value)==1 ||
+			atomic_read(&ep->controller_state->control_details[MP3_OUT_PLAY_PAUSE_BLINK_L].value)==1;
 
-				if (atomic_read(&ep->controller_state->control_details[MP3_OUT_PLAY_PAUSE_BLINK_L].value)==1 ||
-				   atomic_read(&ep->controller_state->control_details[MP3_OUT_PLAY_PAUSE_BLINK_L].value)==1) {
-					check_led_blink_case(ep,
-							      set_left_play_blink,
-							      set_right_play_blink);
-				}
+		/* Update the LED state, and unless the blink case has to adjust it further copy 
+		 *  the report into the URB's buffer under the same lock */
+		spin_lock_irqsave(&ep->controller_state->hid_buffer_lock, flags);
+		if (value) {
+			ep->controller_state->current_hid_report_data[bytepos] |= bitmask;
+		} else {
+			ep->controller_state->current_hid_report_data[bytepos] &= ~bitmask;
+		}
+		if (!flush && !blink) {
+			memcpy(buf,
+				ep->controller_state->current_hid_report_data,
+				DJ_MP3_HID_OUTPUT_REPORT_LEN);
+			urb->transfer_buffer_length = DJ_MP3_HID_OUTPUT_REPORT_LEN;
+		}
+		spin_unlock_irqrestore(&ep->controller_state->hid_buffer_lock, flags);
 
-				spin_lock(&ep->controller_state->hid_buffer_lock);
-				/* copy the data into the URB's buffer */
-				memcpy(buf,
-					ep->controller_state->current_hid_report_data,
-					DJ_MP3_HID_OUTPUT_REPORT_LEN);
-				spin_unlock(&ep->controller_state->hid_buffer_lock);
-				urb->transfer_buffer_length = DJ_MP3_HID_OUTPUT_REPORT_LEN;
-				break;
-			}
+		if (flush) {
+			/* for FLUSH Analogs */
+			snd_hdjmp3_flush_analogs(ep);
+		} else if (blink) {
+			check_led_blink_case(ep,
+					      set_left_play_blink,
+					      set_right_play_blink);
+
+			spin_lock_irqsave(&ep->controller_state->hid_buffer_lock, flags);
+			/* copy the data into the URB's buffer */
+			memcpy(buf,
+				ep->controller_state->current_hid_report_data,
+				DJ_MP3_HID_OUTPUT_REPORT_LEN);
+			spin_unlock_irqrestore(&ep->controller_state->hid_buffer_lock, flags);
+			urb->transfer_buffer_length = DJ_MP3_HID_OUTPUT_REPORT_LEN;
 		}
 	}
 
@@ -459,10 +476,6 @@ int snd_hdjmidi_output_open(snd_rawmidi_substream_t *substream)
 			for (j = 0; j < 0x10; ++j) {
 				if (umidi->endpoints[i].out->ports[j].substream == substream) {
 					port = &umidi->endpoints[i].out->ports[j];
-#ifdef THROTTLE_MP3_RENDER
-					umidi->endpoints[i].out->last_send_time = jiffies + 
-							(THROTTLE_MP3_RENDER_RATE*HZ)/1000;
-#endif
 					break;
 				}
 			}
@@ -572,6 +585,21 @@ void snd_hdjmidi_output_trigger(snd_rawmidi_substream_t *substream, int up_param
 	}
 }
 
+/* returns an output URB to the pool, called from its completion */
+static void snd_hdjmidi_out_urb_done(struct snd_hdjmidi_out_endpoint* ep, struct urb* urb)
+{
+	int i;
+
+	spin_lock(&ep->buffer_lock);
+	for (i = 0; i < ep->num_urbs; ++i) {
+		if (ep->urbs[i]==urb) {
+			ep->active_urbs &= ~(1 << i);
+			break;
+		}
+	}
+	spin_unlock(&ep->buffer_lock);
+}
+
 #if ( LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19) )
 void snd_hdjmidi_out_urb_complete(struct urb* urb)
 #else
@@ -580,9 +608,7 @@ void snd_hdjmidi_out_urb_complete(struct urb* urb, struct pt_regs *junk)
 {
 	struct snd_hdjmidi_out_endpoint* ep = urb->context;
 	
-	spin_lock(&ep->buffer_lock);
-	ep->urb_active = 0;
-	spin_unlock(&ep->buffer_lock);
+	snd_hdjmidi_out_urb_done(ep, urb);
 
 	if (urb->status < 0) {
 		int err = snd_hdjmidi_urb_error(urb->status);
@@ -596,13 +622,14 @@ void snd_hdjmidi_out_urb_complete(struct urb* urb, struct pt_regs *junk)
 	snd_hdjmidi_do_output(ep);
 }
 
-#ifdef THROTTLE_MP3_RENDER
-void midi_render_throttle_timer(unsigned long data)
+/* a token is available again, resume output from the tasklet */
+enum hrtimer_restart midi_render_throttle_timer(struct hrtimer *timer)
 {
-	struct snd_hdjmidi_out_endpoint* ep = (struct snd_hdjmidi_out_endpoint*)data;
-	snd_hdjmidi_do_output(ep);
+	struct snd_hdjmidi_out_endpoint* ep = 
+		container_of(timer, struct snd_hdjmidi_out_endpoint, render_delay_timer);
+	tasklet_schedule(&ep->tasklet);
+	return HRTIMER_NORESTART;
 }
-#endif
 
 /*
  * This is called when some data should be transferred to the device
@@ -610,44 +637,54 @@ void midi_render_throttle_timer(unsigned long data)
  */
 void snd_hdjmidi_do_output(struct snd_hdjmidi_out_endpoint* ep)
 {
-	struct urb* urb = ep->urb;
+	struct urb* urb;
 	unsigned long flags;
+	u64 wait;
+	int i;
 	
 #ifdef RENDER_DATA_PRINTK
 	snd_printk(KERN_INFO"%s()\n",__FUNCTION__);
 #endif
 	spin_lock_irqsave(&ep->buffer_lock, flags);
-	if (ep->urb_active || atomic_read(&ep->umidi->chip->shutdown)==1) {
+	if (atomic_read(&ep->umidi->chip->shutdown)==1) {
 		spin_unlock_irqrestore(&ep->buffer_lock, flags);
 		return;
 	}
 	
-#ifdef THROTTLE_MP3_RENDER
-	/* Only the mp3 need to throttled because it is HID, and we don't want to send
-	 *  faster than every 8 ms */
-	if (ep->umidi->chip->product_code==DJCONTROLLER_PRODUCT_CODE) {
-			if (time_before(jiffies, ep->last_send_time)) {
-				mod_timer(&ep->render_delay_timer,
-							(long)ep->last_send_time-
-							(long)jiffies);
-				spin_unlock_irqrestore(&ep->buffer_lock, flags);
-				return;
+	/* fill and submit idle URBs until the data runs out, so that the next transfer is queued 
+	 *  behind the one in flight.  Transfers to an endpoint complete in submission order. */
+	for (i = 0; i < ep->num_urbs; ++i) {
+		if (ep->active_urbs & (1 << i)) {
+			continue;
+		}
+		urb = ep->urbs[i];
+
+		/* Only the mp3 needs to be throttled because it is HID, and shares the output rate 
+		 *  with HID output reports.  The token is only taken once there is something to send. */
+		if (ep->controller_state!=NULL) {
+			wait = hdj_output_bucket_wait_ns(&ep->umidi->chip->output_bucket);
+			if (wait!=0) {
+				hrtimer_start(&ep->render_delay_timer, ns_to_ktime(wait), HRTIMER_MODE_REL);
+				break;
 			}
-	}
-#endif
+		}
 
-	urb->transfer_buffer_length = 0;
-	ep->umidi->usb_protocol_ops->output(ep);
+		urb->transfer_buffer_length = 0;
+		ep->umidi->usb_protocol_ops->output(ep, urb);
+		if (urb->transfer_buffer_length == 0) {
+			break;
+		}
 
-	if (urb->transfer_buffer_length > 0) {
 		dump_urb("sending", urb->transfer_buffer,
 			 urb->transfer_buffer_length);
 		urb->dev = ep->umidi->chip->dev;
-		ep->urb_active = snd_hdjmidi_submit_urb(ep->umidi, urb, GFP_ATOMIC) >= 0;
-
-		/* new send time allowed */
-		ep->umidi->endpoints[0].out->last_send_time = jiffies + 
-			(THROTTLE_MP3_RENDER_RATE*HZ)/1000;
+		if (snd_hdjmidi_submit_urb(ep->umidi, urb, GFP_ATOMIC) < 0) {
+			break;
+		}
+		ep->active_urbs |= 1 << i;
+		if (ep->controller_state!=NULL) {
+			hdj_output_bucket_take(&ep->umidi->chip->output_bucket);
+		}
 	}
 	spin_unlock_irqrestore(&ep->buffer_lock, flags);
 }
@@ -667,9 +704,7 @@ void hid_ctrl_complete(struct urb* urb, struct pt_regs *junk)
 {
 	struct snd_hdjmidi_out_endpoint* ep = urb->context;
 
-	spin_lock(&ep->buffer_lock);
-	ep->urb_active = 0;
-	spin_unlock(&ep->buffer_lock);
+	snd_hdjmidi_out_urb_done(ep, urb);
 
 	if (urb->status < 0) {
 		int err = snd_hdjmidi_urb_error(urb->status);
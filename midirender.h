@@ -31,16 +31,11 @@
 //#define RENDER_DUMP_URB_THROTTLE
 //#define RENDER_DUMP_URB_THROTTLE_LEVEL		20
 //#define RENDER_POLL_STATE_PRINTK
-/* This is recommended, because the mp3 is actually HID, with a 8ms period- so
- *  therefore it is highly recommended not to exceed this.  Our other devices are
- *  MIDI, and NAK us if we exceed the MIDI rate */
-#define THROTTLE_MP3_RENDER
-
 // TODO tune polling period
 #define POLL_PERIOD_MS		8
 #define POLL_VERSION		0x240
 
-void snd_hdjmidi_standard_output(struct snd_hdjmidi_out_endpoint* ep);
+void snd_hdjmidi_standard_output(struct snd_hdjmidi_out_endpoint* ep, struct urb* urb);
 void snd_hdjmidi_output_standard_packet(struct urb* urb, 
 					uint8_t b0, 
 					uint8_t b1, 
@@ -87,9 +82,7 @@ void midi_led_clear_complete(struct urb* urb, struct pt_regs *junk);
 #endif
 
 u8 mp3w_check_led_state(struct snd_hdjmidi_out_endpoint* ep, u8 called_from_kthread);
-#ifdef THROTTLE_MP3_RENDER
-void midi_render_throttle_timer(unsigned long data);
-#endif
+enum hrtimer_restart midi_render_throttle_timer(struct hrtimer *timer);
 void snd_hdjmidi_do_output(struct snd_hdjmidi_out_endpoint* ep);
 void snd_hdjmidi_out_tasklet(unsigned long data);
 void snd_hdjmidi_output_kill_tasklet(struct snd_hdjmidi_out_endpoint* ep);